@@ -1,10 +1,46 @@
 #include "Object.h"
+#include "quantized.h"
 
-Triangle::Triangle(point3 p0, point3 p1, point3 p2, point3 n) {
-	vertices[0] = p0;
-	vertices[1] = p1;
-	vertices[2] = p2;
-	normal = n;
+void TriangleArrays::resize(int n) {
+	v0x.resize(n); v0y.resize(n); v0z.resize(n);
+	e1x.resize(n); e1y.resize(n); e1z.resize(n);
+	e2x.resize(n); e2y.resize(n); e2z.resize(n);
+}
+
+void TriangleArrays::push_back(const point3& A, const point3& B, const point3& C) {
+	int j = size();
+	resize(j + 1);
+	set(j, A, B - A, C - A);
+}
+
+void TriangleArrays::set(int j, const point3& v0, const point3& edge1, const point3& edge2) {
+	v0x[j] = v0.x; v0y[j] = v0.y; v0z[j] = v0.z;
+	e1x[j] = edge1.x; e1y[j] = edge1.y; e1z[j] = edge1.z;
+	e2x[j] = edge2.x; e2y[j] = edge2.y; e2z[j] = edge2.z;
+}
+
+const FloatArray* TriangleArrays::arrays(int k) const {
+	const FloatArray* all[9] = { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z };
+	return all[k];
+}
+
+
+int Mesh::size() const {
+	return (quantized != NULL) ? quantized->size() : tris.size();
+}
+
+void Mesh::triangle(int j, point3& v0, point3& edge1, point3& edge2) const {
+	if (quantized != NULL) {
+		quantized->triangle(j, v0, edge1, edge2);
+		return;
+	}
+	v0 = tris.v0(j);
+	edge1 = tris.edge1(j);
+	edge2 = tris.edge2(j);
+}
+
+point3 Mesh::normal(int j) const {
+	return (quantized != NULL) ? quantized->normal(j) : tris.normal(j);
 }
 
 
@@ -1,5 +1,6 @@
 #pragma once
 #include "common.h"
+#include "aligned.h"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -10,23 +11,63 @@
 typedef glm::vec4  color4;
 typedef glm::vec4  point4;
 
-class Triangle {
+typedef std::vector<float, AlignedAllocator<float> > FloatArray;
+
+// Triangles of a mesh as a structure of arrays, one float per triangle in
+// each: the first vertex and the two edges leaving it, which is what the
+// intersection kernel in intersect.h takes. A run of neighbouring triangles
+// is a few contiguous loads, and a triangle costs 36 bytes rather than a
+// heap allocated vertices-and-normal block plus the pointer to it.
+// The other two vertices and the normal are derived.
+class TriangleArrays {
 public:
-	point3 vertices[3];
-	point3 normal;
+	FloatArray v0x, v0y, v0z;
+	FloatArray e1x, e1y, e1z;
+	FloatArray e2x, e2y, e2z;
+
+	int size() const { return int(v0x.size()); }
+	bool empty() const { return v0x.empty(); }
+	void resize(int n);
+	void push_back(const point3& A, const point3& B, const point3& C);
+	void set(int j, const point3& v0, const point3& edge1, const point3& edge2);
+
+	point3 v0(int j) const { return point3(v0x[j], v0y[j], v0z[j]); }
+	point3 edge1(int j) const { return point3(e1x[j], e1y[j], e1z[j]); }
+	point3 edge2(int j) const { return point3(e2x[j], e2y[j], e2z[j]); }
+	point3 vertex(int j, int v) const {
+		return (v == 0) ? v0(j) : v0(j) + ((v == 1) ? edge1(j) : edge2(j));
+	}
+	point3 normal(int j) const { return glm::cross(edge1(j), edge2(j)); } // Not normalized
 
-	Triangle(point3 p0, point3 p1, point3 p2, point3 n);
+	// The nine arrays in a fixed order, for hashing and comparing.
+	const FloatArray* arrays(int k) const;
 };
 
-class Object {
+class BVH;
+class QuantizedMesh;
+
+// Triangle list of a model, in its own space. Mesh objects with the same
+// triangles share one Mesh and place it with their own transform.
+// Large meshes are kept quantized instead of in tris, see quantized.h,
+// and the accessors below read whichever is there.
+class Mesh {
 public:
-	int type;
+	TriangleArrays tris;
+	QuantizedMesh* quantized = NULL; // tris is empty when set
+	int users = 0; // Mesh objects placing it
+	BVH* blas = NULL; // Bottom-level BVH, only built for instanced meshes
 
-	point3 pos = point3(0.f, 0.f, 0.f);
-	float radius = 0.f;
-	point3 normal = point3(0.f, 0.f, 0.f);
-	std::vector<Triangle *> tris;
+	int size() const;
+	void triangle(int j, point3& v0, point3& edge1, point3& edge2) const;
+	point3 normal(int j) const; // Not normalized
+};
 
+// Shading properties, only read once the closest hit is known. They live in
+// a table of their own that objects index, so that the geometry the
+// intersection loops walk carries none of them, and objects with the same
+// material share one entry.
+class Material {
+public:
 	colour3 ambient = colour3(0.f, 0.f, 0.f);
 	colour3 diffuse = colour3(0.f, 0.f, 0.f);
 	colour3 specular = colour3(0.f, 0.f, 0.f);
@@ -34,6 +75,21 @@ public:
 	colour3 reflective = colour3(0.f, 0.f, 0.f);
 	colour3 transmissive = colour3(0.f, 0.f, 0.f);
 	float refraction = 0.f;
+};
+
+class Object {
+public:
+	int type;
+
+	point3 pos = point3(0.f, 0.f, 0.f);
+	float radius = 0.f;
+	point3 normal = point3(0.f, 0.f, 0.f);
+	Mesh* mesh = NULL;
+	glm::mat4 transform = glm::mat4(1.f); // Mesh space to world space
+	glm::mat4 inverse = glm::mat4(1.f);
+	bool instanced = false; // Traced through mesh->blas instead of the scene BVH
+
+	int material = 0; // Index into the material table
 
 	Object(int theType);
 };
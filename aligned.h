@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+
+// std::allocator only honours over-aligned types from C++17 on, so arrays that
+// have to start on a cache line (BVH nodes, packed primitives) use this instead.
+template <typename T, size_t ALIGN = 64>
+class AlignedAllocator {
+public:
+	typedef T value_type;
+	template <typename U> struct rebind { typedef AlignedAllocator<U, ALIGN> other; };
+
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U, ALIGN>&) {}
+
+	T* allocate(size_t n) {
+		// Over-allocate and remember the real block just before the aligned one.
+		void* raw = malloc(n * sizeof(T) + ALIGN + sizeof(void *));
+		if (raw == NULL) { throw std::bad_alloc(); }
+
+		uintptr_t p = (reinterpret_cast<uintptr_t>(raw) + sizeof(void *) + ALIGN - 1) & ~uintptr_t(ALIGN - 1);
+		reinterpret_cast<void **>(p)[-1] = raw;
+		return reinterpret_cast<T *>(p);
+	}
+	void deallocate(T* p, size_t) {
+		if (p != NULL) {
+			free(reinterpret_cast<void **>(p)[-1]);
+		}
+	}
+};
+
+template <typename T, typename U, size_t ALIGN>
+bool operator==(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&) { return true; }
+template <typename T, typename U, size_t ALIGN>
+bool operator!=(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&) { return false; }
@@ -0,0 +1,234 @@
+#include "batch.h"
+#include "intersect.h"
+#include "simd.h"
+
+#include <cmath>
+#include <limits>
+
+
+/****************************************************************************/
+
+void PrimitiveLanes::resize(int n) {
+	int lanes = (n > 0) ? n + BATCH_WIDTH - 1 : 0;
+	int old = tris.size();
+	tris.resize(lanes);
+	radius2.resize(lanes);
+
+	for (int i = old; i < lanes; i++) {
+		setEmpty(i);
+	}
+}
+
+void PrimitiveLanes::clear() {
+	resize(0);
+}
+
+void PrimitiveLanes::setTriangle(int i, const point3& v0, const point3& edge1, const point3& edge2) {
+	tris.set(i, v0, edge1, edge2);
+	radius2[i] = std::numeric_limits<float>::quiet_NaN();
+}
+
+void PrimitiveLanes::setSphere(int i, const point3& centre, float r2) {
+	tris.set(i, centre, point3(0.f), point3(0.f));
+	radius2[i] = r2;
+}
+
+void PrimitiveLanes::setEmpty(int i) {
+	setTriangle(i, point3(0.f), point3(0.f), point3(0.f));
+}
+
+/****************************************************************************/
+
+// The reference every other kernel has to match.
+static void intersectBatchScalar(const PrimitiveLanes& lanes, int first, int count, const Ray& ray, float* t) {
+	const TriangleArrays& tris = lanes.tris;
+
+	for (int k = 0; k < count; k++) {
+		int i = first + k;
+		if (std::isnan(lanes.radius2[i])) {
+			t[k] = intersectTriangle(tris.v0(i), tris.edge1(i), tris.edge2(i), ray);
+		}
+		else {
+			t[k] = intersectSphere(tris.v0(i), lanes.radius2[i], ray);
+		}
+	}
+}
+
+#if SIMD_X86
+
+// The vector kernels repeat the scalar tests operation for operation, in the
+// same order and without FMA, so every lane rounds exactly like the scalar
+// code. Comparisons are the ordered kind, false on NaN like the C++ ones.
+
+SIMD_BEGIN_SSE41
+
+static void intersectBatch4(const PrimitiveLanes& lanes, int first, int mask, const Ray& ray, float* t) {
+	const TriangleArrays& tris = lanes.tris;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 signBit = _mm_set1_ps(-0.f);
+	const __m128 antiAcne = _mm_set1_ps(ray.tmin);
+	const __m128 miss = _mm_set1_ps(FLT_MAX);
+
+	__m128 dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y), dz = _mm_set1_ps(ray.d.z);
+	__m128 sx = _mm_sub_ps(_mm_set1_ps(ray.e.x), _mm_loadu_ps(&tris.v0x[first]));
+	__m128 sy = _mm_sub_ps(_mm_set1_ps(ray.e.y), _mm_loadu_ps(&tris.v0y[first]));
+	__m128 sz = _mm_sub_ps(_mm_set1_ps(ray.e.z), _mm_loadu_ps(&tris.v0z[first]));
+	__m128 r2 = _mm_loadu_ps(&lanes.radius2[first]);
+	__m128 isSphere = _mm_cmpord_ps(r2, r2);
+	int spheres = _mm_movemask_ps(isSphere) & mask;
+
+	__m128 result = miss;
+	if (spheres != mask) { // intersectTriangle()
+		__m128 e1x = _mm_loadu_ps(&tris.e1x[first]), e1y = _mm_loadu_ps(&tris.e1y[first]), e1z = _mm_loadu_ps(&tris.e1z[first]);
+		__m128 e2x = _mm_loadu_ps(&tris.e2x[first]), e2y = _mm_loadu_ps(&tris.e2y[first]), e2z = _mm_loadu_ps(&tris.e2z[first]);
+
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 invDet = _mm_div_ps(one, det);
+
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+		__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+		__m128 backFacing = _mm_cmplt_ps(det, zero);
+		__m128 threshold = _mm_blendv_ps(antiAcne, _mm_div_ps(antiAcne, _mm_xor_ps(det, signBit)), backFacing);
+
+		__m128 outside = _mm_or_ps(_mm_cmpeq_ps(det, zero), _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+		outside = _mm_or_ps(outside, _mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+		__m128 hit = _mm_andnot_ps(outside, _mm_cmpgt_ps(tt, threshold));
+		result = _mm_blendv_ps(miss, tt, hit);
+	}
+	if (spheres != 0) { // intersectSphere()
+		__m128 ux = _mm_set1_ps(ray.dir.x), uy = _mm_set1_ps(ray.dir.y), uz = _mm_set1_ps(ray.dir.z);
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, ux), _mm_mul_ps(sy, uy)), _mm_mul_ps(sz, uz));
+		__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), _mm_mul_ps(sz, sz)), r2);
+		__m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+
+		__m128 root = _mm_sqrt_ps(discriminant);
+		__m128 negB = _mm_xor_ps(b, signBit);
+		__m128 invLength = _mm_set1_ps(ray.invLength);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(negB, root), invLength);
+		__m128 t2 = _mm_mul_ps(_mm_add_ps(negB, root), invLength);
+		t1 = _mm_blendv_ps(miss, t1, _mm_cmpgt_ps(t1, antiAcne));
+		t2 = _mm_blendv_ps(miss, t2, _mm_cmpgt_ps(t2, antiAcne));
+		__m128 ts = _mm_blendv_ps(miss, _mm_min_ps(t2, t1), _mm_cmpge_ps(discriminant, zero));
+		result = _mm_blendv_ps(result, ts, isSphere);
+	}
+	_mm_storeu_ps(t, result);
+}
+
+static void intersectBatchSSE41(const PrimitiveLanes& lanes, int first, int count, const Ray& ray, float* t) {
+	for (int k = 0; k < count; k += 4) {
+		int n = (count - k < 4) ? count - k : 4;
+		intersectBatch4(lanes, first + k, (1 << n) - 1, ray, t + k);
+	}
+}
+
+SIMD_END
+
+SIMD_BEGIN_AVX2
+
+static void intersectBatchAVX2(const PrimitiveLanes& lanes, int first, int count, const Ray& ray, float* t) {
+	const TriangleArrays& tris = lanes.tris;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.f);
+	const __m256 signBit = _mm256_set1_ps(-0.f);
+	const __m256 antiAcne = _mm256_set1_ps(ray.tmin);
+	const __m256 miss = _mm256_set1_ps(FLT_MAX);
+	int mask = (1 << count) - 1;
+
+	__m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+	__m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.e.x), _mm256_loadu_ps(&tris.v0x[first]));
+	__m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.e.y), _mm256_loadu_ps(&tris.v0y[first]));
+	__m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.e.z), _mm256_loadu_ps(&tris.v0z[first]));
+	__m256 r2 = _mm256_loadu_ps(&lanes.radius2[first]);
+	__m256 isSphere = _mm256_cmp_ps(r2, r2, _CMP_ORD_Q);
+	int spheres = _mm256_movemask_ps(isSphere) & mask;
+
+	__m256 result = miss;
+	if (spheres != mask) { // intersectTriangle()
+		__m256 e1x = _mm256_loadu_ps(&tris.e1x[first]), e1y = _mm256_loadu_ps(&tris.e1y[first]), e1z = _mm256_loadu_ps(&tris.e1z[first]);
+		__m256 e2x = _mm256_loadu_ps(&tris.e2x[first]), e2y = _mm256_loadu_ps(&tris.e2y[first]), e2z = _mm256_loadu_ps(&tris.e2z[first]);
+
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		__m256 invDet = _mm256_div_ps(one, det);
+
+		__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), invDet);
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+		__m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+
+		__m256 backFacing = _mm256_cmp_ps(det, zero, _CMP_LT_OQ);
+		__m256 threshold = _mm256_blendv_ps(antiAcne, _mm256_div_ps(antiAcne, _mm256_xor_ps(det, signBit)), backFacing);
+
+		__m256 outside = _mm256_or_ps(_mm256_cmp_ps(det, zero, _CMP_EQ_OQ),
+									  _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(u, one, _CMP_GT_OQ)));
+		outside = _mm256_or_ps(outside, _mm256_or_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ),
+													 _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ)));
+		__m256 hit = _mm256_andnot_ps(outside, _mm256_cmp_ps(tt, threshold, _CMP_GT_OQ));
+		result = _mm256_blendv_ps(miss, tt, hit);
+	}
+	if (spheres != 0) { // intersectSphere()
+		__m256 ux = _mm256_set1_ps(ray.dir.x), uy = _mm256_set1_ps(ray.dir.y), uz = _mm256_set1_ps(ray.dir.z);
+		__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, ux), _mm256_mul_ps(sy, uy)), _mm256_mul_ps(sz, uz));
+		__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, sx), _mm256_mul_ps(sy, sy)), _mm256_mul_ps(sz, sz)), r2);
+		__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+
+		__m256 root = _mm256_sqrt_ps(discriminant);
+		__m256 negB = _mm256_xor_ps(b, signBit);
+		__m256 invLength = _mm256_set1_ps(ray.invLength);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(negB, root), invLength);
+		__m256 t2 = _mm256_mul_ps(_mm256_add_ps(negB, root), invLength);
+		t1 = _mm256_blendv_ps(miss, t1, _mm256_cmp_ps(t1, antiAcne, _CMP_GT_OQ));
+		t2 = _mm256_blendv_ps(miss, t2, _mm256_cmp_ps(t2, antiAcne, _CMP_GT_OQ));
+		__m256 ts = _mm256_blendv_ps(miss, _mm256_min_ps(t2, t1), _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ));
+		result = _mm256_blendv_ps(result, ts, isSphere);
+	}
+	_mm256_storeu_ps(t, result);
+}
+
+SIMD_END
+
+#endif
+
+/****************************************************************************/
+
+typedef void (*BatchKernel)(const PrimitiveLanes&, int, int, const Ray&, float*);
+
+static BatchKernel kernel = intersectBatchScalar;
+static int activeKernel = selectBatchKernel(BATCH_AVX2);
+
+int selectBatchKernel(int wanted) {
+	activeKernel = BATCH_SCALAR;
+	kernel = intersectBatchScalar;
+#if SIMD_X86
+	if (wanted >= BATCH_AVX2 && cpuHasAVX2()) {
+		activeKernel = BATCH_AVX2;
+		kernel = intersectBatchAVX2;
+	}
+	else if (wanted >= BATCH_SSE41 && cpuHasSSE41()) {
+		activeKernel = BATCH_SSE41;
+		kernel = intersectBatchSSE41;
+	}
+#endif
+	return activeKernel;
+}
+
+int batchKernel() {
+	return activeKernel;
+}
+
+void intersectBatch(const PrimitiveLanes& lanes, int first, int count, const Ray& ray, float* t) {
+	kernel(lanes, first, count, ray, t);
+}
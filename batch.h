@@ -0,0 +1,37 @@
+#pragma once
+#include "Object.h"
+#include "intersect.h"
+
+
+const int BATCH_WIDTH = 8; // Most lanes one intersectBatch() call tests
+
+// Kernels intersectBatch() can run, best one the CPU has by default.
+enum { BATCH_SCALAR, BATCH_SSE41, BATCH_AVX2 };
+
+// Structure-of-arrays copy of the packed primitives of a BVH, so that a leaf
+// is a few vector loads. Triangle lanes hold the vertex and edges, sphere
+// lanes the centre in tris.v0 and the squared radius. Other lanes are made to
+// miss: zero edges never hit as a triangle and a NaN radius2 marks them as
+// not being spheres.
+class PrimitiveLanes {
+public:
+	TriangleArrays tris;
+	FloatArray radius2;
+
+	void resize(int n); // Adds BATCH_WIDTH - 1 padding lanes, so a batch can start at any lane
+	void clear();
+	void setTriangle(int i, const point3& v0, const point3& edge1, const point3& edge2);
+	void setSphere(int i, const point3& centre, float r2);
+	void setEmpty(int i);
+};
+
+// Distances along ray.d to lanes [first, first + count) in t[0, count), count at
+// most BATCH_WIDTH, FLT_MAX for a miss. Bit for bit what intersectTriangle()
+// and intersectSphere() return, whichever kernel runs. t needs room for
+// BATCH_WIDTH values, the ones past count are garbage.
+void intersectBatch(const PrimitiveLanes& lanes, int first, int count, const Ray& ray, float* t);
+
+// Force a kernel, for comparing them. Falls back to the best one the CPU
+// supports and returns what was selected.
+int selectBatchKernel(int kernel);
+int batchKernel();
@@ -0,0 +1,148 @@
+// Microbenchmark for intersectSphere(), against the kernel it replaced. Not
+// part of the renderer build, compile it on its own:
+//   clang++ -std=c++11 -O2 -I../../glm -I.. sphere.cpp ../Object.cpp ../quantized.cpp -o sphere
+// Each ray is tested against a small cluster of spheres, as it would be
+// against the leaves along its path through a BVH. Half the rays start
+// outside and half inside the spheres, as refracted rays in glass balls do.
+
+#include "intersect.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+
+// The kernel before the ray was normalized up front.
+static inline float intersectSphereOld(const point3& pos, float r, const point3& e, const point3& d) {
+	point3 emc = e - pos;
+	float t = FLT_MAX;
+
+	float discriminant = glm::dot(d, emc) * glm::dot(d, emc) - glm::dot(d, d) * (glm::dot(emc, emc) - r * r);
+
+	if (discriminant >= 0.f) {
+		float t1 = (glm::dot(-d, emc) + glm::sqrt(discriminant)) / glm::dot(d, d);
+		float t2 = (glm::dot(-d, emc) - glm::sqrt(discriminant)) / glm::dot(d, d);
+		t1 = (t1 > ANTI_ACNE) ? t1 : FLT_MAX;
+		t2 = (t2 > ANTI_ACNE) ? t2 : FLT_MAX;
+		t = std::min(t1, t2);
+	}
+	return t;
+}
+
+class Sphere {
+public:
+	point3 centre;
+	float r;
+	float r2;
+};
+
+int main() {
+	const int NUM_SPHERES = 64; // Close to the tests per ray of a scene of glass balls
+	const int NUM_RAYS = 1 << 20;
+	const int PASSES = 10;
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+
+	std::vector<Sphere> spheres(NUM_SPHERES);
+	for (Sphere& s : spheres) {
+		s.centre = point3(uniform(rng), uniform(rng), uniform(rng));
+		s.r = 0.2f + 0.4f * std::abs(uniform(rng));
+		s.r2 = s.r * s.r;
+	}
+
+	// Primary rays over a 1024 x 512 image of the cluster, then as many
+	// starting inside the spheres, fanning out from just off each centre.
+	// Both sets go in scanline order, so neighbouring rays behave alike as
+	// they do in a render. Directions are left unnormalized.
+	const int WIDTH = 1024;
+	std::vector<point3> origins(NUM_RAYS), directions(NUM_RAYS);
+	for (int i = 0; i < NUM_RAYS / 2; i++) {
+		float x = float(i % WIDTH) / WIDTH * 4.f - 2.f;
+		float y = float(i / WIDTH) / (NUM_RAYS / 2 / WIDTH) * 4.f - 2.f;
+		origins[i] = point3(0.f, 0.f, 8.f);
+		directions[i] = point3(x, y, 0.f) - origins[i];
+	}
+	for (int i = NUM_RAYS / 2; i < NUM_RAYS; i++) {
+		int k = i - NUM_RAYS / 2;
+		const Sphere& s = spheres[k * NUM_SPHERES / (NUM_RAYS / 2)];
+		float theta = float(k % WIDTH) / WIDTH * 6.2831853f;
+		float z = float(k / WIDTH % 64) / 32.f - 1.f;
+		origins[i] = s.centre + 0.1f * s.r * point3(1.f, 1.f, 1.f);
+		directions[i] = 3.f * point3(std::sqrt(1.f - z * z) * std::cos(theta), std::sqrt(1.f - z * z) * std::sin(theta), z);
+	}
+
+	// Only spheres whose box the ray enters are tested, as in a BVH leaf, and
+	// only while that box starts before the closest hit so far. That makes
+	// each test wait on the ones before it, as traversal does.
+	std::vector<int> candidates;
+	std::vector<float> entry;
+	std::vector<int> first(NUM_RAYS + 1, 0);
+	for (int i = 0; i < NUM_RAYS; i++) {
+		point3 invD = 1.f / directions[i];
+		for (int k = 0; k < NUM_SPHERES; k++) {
+			float tmin = 0.f;
+			float tmax = FLT_MAX;
+			for (int a = 0; a < 3; a++) {
+				float t0 = (spheres[k].centre[a] - spheres[k].r - origins[i][a]) * invD[a];
+				float t1 = (spheres[k].centre[a] + spheres[k].r - origins[i][a]) * invD[a];
+				tmin = std::max(tmin, std::min(t0, t1));
+				tmax = std::min(tmax, std::max(t0, t1));
+			}
+			if (tmin <= tmax) {
+				candidates.push_back(k);
+				entry.push_back(tmin);
+			}
+		}
+		first[i + 1] = candidates.size();
+	}
+
+	typedef std::chrono::high_resolution_clock Clock;
+	double best[2] = { 1e30, 1e30 };
+	float sums[2] = { 0.f, 0.f };
+	int hits[2] = { 0, 0 };
+
+	for (int pass = 0; pass < PASSES; pass++) {
+		for (int kernel = 0; kernel < 2; kernel++) {
+			float sum = 0.f;
+			int count = 0;
+			Clock::time_point start = Clock::now();
+
+			for (int i = 0; i < NUM_RAYS; i++) {
+				float closest = FLT_MAX;
+				if (kernel == 0) {
+					for (int j = first[i]; j < first[i + 1]; j++) {
+						if (entry[j] > closest) { continue; }
+						const Sphere& s = spheres[candidates[j]];
+						closest = std::min(closest, intersectSphereOld(s.centre, s.r, origins[i], directions[i]));
+					}
+				}
+				else {
+					Ray ray(origins[i], directions[i]);
+					for (int j = first[i]; j < first[i + 1]; j++) {
+						if (entry[j] > closest) { continue; }
+						const Sphere& s = spheres[candidates[j]];
+						closest = std::min(closest, intersectSphere(s.centre, s.r2, ray));
+					}
+				}
+				if (closest < FLT_MAX) {
+					sum += closest;
+					count++;
+				}
+			}
+
+			double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+			best[kernel] = std::min(best[kernel], seconds);
+			sums[kernel] = sum;
+			hits[kernel] = count;
+		}
+	}
+
+	double tests = double(candidates.size());
+	printf("%d rays, %.1f tests per ray\n", NUM_RAYS, tests / NUM_RAYS);
+	printf("old: %.2f ns/test, %d hits, sum %g\n", best[0] * 1e9 / tests, hits[0], sums[0]);
+	printf("new: %.2f ns/test, %d hits, sum %g\n", best[1] * 1e9 / tests, hits[1], sums[1]);
+	printf("speedup %.2fx\n", best[0] / best[1]);
+	return 0;
+}
@@ -0,0 +1,527 @@
+#include "bvh.h"
+#include "intersect.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+
+const int SAH_BINS = 12;
+const int MAX_LEAF_PRIMS = 4;
+const int MAX_DEPTH = 60; // Well inside BVH_STACK_SIZE
+const int MAX_NODE_PRIMS = 65535; // LinearBVHNode::numPrims is 16 bits
+const float TRAVERSAL_COST = 1.f; // Relative to one primitive test
+const float REBUILD_RATIO = 1.5f; // Refit until the SAH cost grows by this much
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be half a cache line");
+
+TraversalStats traversalStats;
+
+
+void printTraversalStats() {
+#ifdef TRAVERSAL_STATS
+	double rays = double(std::max(traversalStats.rays, 1LL));
+	std::cout << "Traversal: " << traversalStats.rays << " rays, "
+		<< traversalStats.nodes / rays << " nodes/ray, "
+		<< traversalStats.prims / rays << " tests/ray\n";
+#endif
+}
+
+
+BVHNode::~BVHNode() {
+	delete children[0];
+	delete children[1];
+}
+
+void BVH::clear() {
+	prims.clear();
+	nodes.clear();
+	packed.clear();
+	lanes.clear();
+	blas.clear();
+	parents.clear();
+	primLeaf.clear();
+	objectPrimStart.clear();
+	objectPrims.clear();
+	refitted.clear();
+	dirty.clear();
+	quantized = NULL;
+	builtCost = 0.f;
+	costSum = 0.0;
+}
+
+/****************************************************************************/
+
+// Every sphere and every mesh triangle becomes one primitive, except that an
+// instanced mesh is one primitive as a whole.
+void BVH::gatherPrimitives(const std::vector<Object *>& objs) {
+	blas.assign(objs.size(), NULL);
+
+	for (int i = 0; i < objs.size(); i++) {
+		Object* object = objs[i];
+
+		if (object->type == SPHERE) {
+			Primitive prim;
+			prim.object = i;
+			prim.triangle = -1;
+			prims.push_back(prim);
+		}
+		else if (object->type == MESH && object->instanced) {
+			Primitive prim;
+			prim.object = i;
+			prim.triangle = INSTANCE_PRIM;
+			prims.push_back(prim);
+			blas[i] = object->mesh->blas;
+		}
+		else if (object->type == MESH) {
+			for (int j = 0; j < object->mesh->tris.size(); j++) {
+				Primitive prim;
+				prim.object = i;
+				prim.triangle = j;
+				prims.push_back(prim);
+			}
+		}
+	}
+
+	parallelFor(0, prims.size(), [&](int i) {
+		primitiveBounds(objs, prims[i]);
+	});
+}
+
+void BVH::primitiveBounds(const std::vector<Object *>& objs, Primitive& prim) const {
+	Object* object = objs[prim.object];
+	prim.bounds = AABB();
+
+	if (prim.triangle == INSTANCE_PRIM) {
+		// World box around the transformed corners of the mesh BVH's root.
+		AABB local = object->mesh->blas->nodes[0].bounds();
+		for (int c = 0; c < 8; c++) {
+			point3 corner((c & 1) ? local.max.x : local.min.x,
+						  (c & 2) ? local.max.y : local.min.y,
+						  (c & 4) ? local.max.z : local.min.z);
+			prim.bounds.grow(point3(object->transform * glm::vec4(corner, 1)));
+		}
+		prim.centroid = prim.bounds.centroid();
+	}
+	else if (prim.triangle < 0) {
+		prim.bounds.grow(object->pos - point3(object->radius, object->radius, object->radius));
+		prim.bounds.grow(object->pos + point3(object->radius, object->radius, object->radius));
+		prim.centroid = object->pos;
+	}
+	else {
+		for (int v = 0; v < 3; v++) {
+			prim.bounds.grow(object->mesh->tris.vertex(prim.triangle, v));
+		}
+		prim.centroid = prim.bounds.centroid();
+	}
+}
+
+void BVH::build(const std::vector<Object *>& objs) {
+	clear();
+	gatherPrimitives(objs);
+
+	if (!prims.empty()) {
+		BVHNode* root = buildRecursive(0, prims.size(), 0);
+		flatten(root);
+		delete root;
+		pack(objs);
+	}
+	prepareRefit(objs.size());
+}
+
+BVHNode* BVH::buildRecursive(int first, int last, int depth) {
+	BVHNode* node = new BVHNode();
+	AABB centroidBounds;
+
+	for (int i = first; i < last; i++) {
+		node->bounds.grow(prims[i].bounds);
+		centroidBounds.grow(prims[i].centroid);
+	}
+
+	int count = last - first;
+	int axis = centroidBounds.maxExtent();
+	float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+
+	// All centroids coincide, so no split can separate them.
+	if (count <= 1 || ((depth >= MAX_DEPTH || extent <= 0.f) && count <= MAX_NODE_PRIMS)) {
+		node->firstPrim = first;
+		node->numPrims = count;
+		return node;
+	}
+	if (extent <= 0.f) { // Too many to fit in one leaf, split them arbitrarily
+		int middle = (first + last) / 2;
+		node->children[0] = buildRecursive(first, middle, depth + 1);
+		node->children[1] = buildRecursive(middle, last, depth + 1);
+		return node;
+	}
+
+	// Bin the centroids along the widest axis and sweep for the cheapest split.
+	int binCounts[SAH_BINS] = { 0 };
+	AABB binBounds[SAH_BINS];
+
+	for (int i = first; i < last; i++) {
+		int b = int(SAH_BINS * ((prims[i].centroid[axis] - centroidBounds.min[axis]) / extent));
+		b = std::min(b, SAH_BINS - 1);
+		binCounts[b]++;
+		binBounds[b].grow(prims[i].bounds);
+	}
+
+	float rightArea[SAH_BINS];
+	int rightCount[SAH_BINS];
+	AABB right;
+	int countR = 0;
+	for (int b = SAH_BINS - 1; b > 0; b--) {
+		right.grow(binBounds[b]);
+		countR += binCounts[b];
+		rightArea[b] = right.surfaceArea();
+		rightCount[b] = countR;
+	}
+
+	float bestCost = FLT_MAX;
+	int bestSplit = -1;
+	AABB left;
+	int countL = 0;
+	for (int b = 1; b < SAH_BINS; b++) {
+		left.grow(binBounds[b - 1]);
+		countL += binCounts[b - 1];
+		if (countL == 0 || rightCount[b] == 0) { continue; }
+
+		float cost = countL * left.surfaceArea() + rightCount[b] * rightArea[b];
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestSplit = b;
+		}
+	}
+
+	float leafCost = float(count);
+	float splitCost = TRAVERSAL_COST + bestCost / node->bounds.surfaceArea();
+
+	if (bestSplit < 0 || (count <= MAX_LEAF_PRIMS && leafCost <= splitCost)) {
+		node->firstPrim = first;
+		node->numPrims = count;
+		return node;
+	}
+
+	Primitive* mid = std::partition(&prims[first], &prims[first] + count, [&](const Primitive& p) {
+		int b = int(SAH_BINS * ((p.centroid[axis] - centroidBounds.min[axis]) / extent));
+		return std::min(b, SAH_BINS - 1) < bestSplit;
+	});
+	int middle = first + int(mid - &prims[first]);
+
+	// Binning put everything on one side through rounding, fall back to a median split.
+	if (middle == first || middle == last) {
+		middle = (first + last) / 2;
+		std::nth_element(&prims[first], &prims[middle], &prims[first] + count, [&](const Primitive& a, const Primitive& b) {
+			return a.centroid[axis] < b.centroid[axis];
+		});
+	}
+
+	node->axis = axis;
+	node->children[0] = buildRecursive(first, middle, depth + 1);
+	node->children[1] = buildRecursive(middle, last, depth + 1);
+	return node;
+}
+
+// Lay the tree out depth-first, returns the index of the node written.
+int BVH::flatten(const BVHNode* node) {
+	int index = nodes.size();
+	nodes.push_back(LinearBVHNode());
+
+	LinearBVHNode linear;
+	linear.min = node->bounds.min;
+	linear.max = node->bounds.max;
+	linear.axis = (unsigned char)node->axis;
+	linear.pad = 0;
+
+	if (node->children[0] == NULL) {
+		linear.offset = node->firstPrim;
+		linear.numPrims = (unsigned short)node->numPrims;
+	}
+	else {
+		flatten(node->children[0]);
+		linear.offset = flatten(node->children[1]);
+		linear.numPrims = 0;
+	}
+	nodes[index] = linear;
+	return index;
+}
+
+// Copy each primitive's geometry into leaf order.
+void BVH::pack(const std::vector<Object *>& objs) {
+	packed.resize(prims.size());
+	lanes.clear();
+	lanes.resize(prims.size());
+
+	parallelFor(0, prims.size(), [&](int i) {
+		packPrimitive(objs, i);
+	});
+}
+
+void BVH::packPrimitive(const std::vector<Object *>& objs, int i) {
+	Object* object = objs[prims[i].object];
+	PackedPrimitive& p = packed[i];
+
+	p.object = prims[i].object;
+	p.triangle = prims[i].triangle;
+
+	if (p.triangle == INSTANCE_PRIM) {
+		const glm::mat4& inv = object->inverse;
+		p.v0 = point3(inv[0][0], inv[1][0], inv[2][0]);
+		p.v1 = point3(inv[0][1], inv[1][1], inv[2][1]);
+		p.v2 = point3(inv[0][2], inv[1][2], inv[2][2]);
+		p.normal = point3(inv[3]);
+	}
+	else if (p.triangle < 0) {
+		p.v0 = object->pos;
+		p.v1 = point3(object->radius, object->radius * object->radius, 0);
+	}
+	else {
+		const TriangleArrays& tris = object->mesh->tris;
+		p.v0 = tris.v0(p.triangle);
+		p.v1 = tris.edge1(p.triangle);
+		p.v2 = tris.edge2(p.triangle);
+	}
+	packLanes(i);
+}
+
+void BVH::packLanes(int i) {
+	const PackedPrimitive& p = packed[i];
+
+	if (p.triangle == INSTANCE_PRIM) {
+		lanes.setEmpty(i);
+	}
+	else if (p.triangle < 0) {
+		lanes.setSphere(i, p.v0, p.v1.y);
+	}
+	else {
+		lanes.setTriangle(i, p.v0, p.v1, p.v2);
+	}
+}
+
+/****************************************************************************/
+
+bool BVH::intersect(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	if (nodes.empty()) { return false; }
+
+	bool hit = false;
+	dist = std::min(dist, ray.tmax);
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	int current = 0;
+	COUNT_STAT(rays, 1);
+
+	while (true) {
+		const LinearBVHNode& node = nodes[current];
+		COUNT_STAT(nodes, 1);
+
+		// The box test is clipped to dist, so subtrees that start beyond the
+		// closest hit so far are skipped when they come off the stack.
+		if (intersectBounds(node, ray, dist)) {
+			if (node.numPrims > 0) {
+				hit |= intersectLeaf(node.offset, node.numPrims, ray, dist, indexOfClosest, indexOfTriangle);
+			}
+			else {
+				// Visit the child on the near side of the split first.
+				if (ray.sign[node.axis]) {
+					stack[top++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[top++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+		if (top == 0) { break; }
+		current = stack[--top];
+	}
+	return hit;
+}
+
+// Same walk as intersect(), but the box tests stay clipped to ray.tmax and
+// the first hit ends it.
+bool BVH::occluded(const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	if (nodes.empty()) { return false; }
+
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	int current = 0;
+	COUNT_STAT(rays, 1);
+
+	while (true) {
+		const LinearBVHNode& node = nodes[current];
+		COUNT_STAT(nodes, 1);
+
+		if (intersectBounds(node, ray, ray.tmax)) {
+			if (node.numPrims > 0) {
+				if (occludedLeaf(node.offset, node.numPrims, ray, ignoreObject, ignoreTriangle)) {
+					return true;
+				}
+			}
+			else {
+				if (ray.sign[node.axis]) {
+					stack[top++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[top++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+		if (top == 0) { break; }
+		current = stack[--top];
+	}
+	return false;
+}
+
+// intersectLeaf() with the spheres and triangles tested by intersectBatch(),
+// BATCH_WIDTH at a time. The distances are then taken in packed order like
+// the one at a time loop does, so ties still go to the first primitive.
+bool BVH::intersectLeafBatch(int first, int count, const Ray& ray,
+							 float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	bool hit = false;
+	COUNT_STAT(prims, count);
+
+	for (int batch = first; batch < first + count; batch += BATCH_WIDTH) {
+		int n = std::min(first + count - batch, BATCH_WIDTH);
+		float t[BATCH_WIDTH];
+		intersectBatch(lanes, batch, n, ray, t);
+
+		for (int k = 0; k < n; k++) {
+			const PackedPrimitive& p = packed[batch + k];
+
+			if (p.triangle == INSTANCE_PRIM) {
+				hit |= intersectInstance(p, ray, dist, indexOfClosest, indexOfTriangle);
+			}
+			else if (t[k] < dist) {
+				dist = t[k];
+				indexOfClosest = p.object;
+				indexOfTriangle = p.triangle;
+				hit = true;
+			}
+		}
+	}
+	return hit;
+}
+
+bool BVH::occludedLeafBatch(int first, int count, const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	COUNT_STAT(prims, count);
+
+	for (int batch = first; batch < first + count; batch += BATCH_WIDTH) {
+		int n = std::min(first + count - batch, BATCH_WIDTH);
+		float t[BATCH_WIDTH];
+		intersectBatch(lanes, batch, n, ray, t);
+
+		for (int k = 0; k < n; k++) {
+			const PackedPrimitive& p = packed[batch + k];
+
+			if (p.triangle == INSTANCE_PRIM) {
+				if (occludedInstance(p, ray, ignoreObject, ignoreTriangle)) { return true; }
+			}
+			else if (t[k] < ray.tmax && (p.object != ignoreObject || p.triangle != ignoreTriangle)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/****************************************************************************/
+/******************************** Refitting *********************************/
+/****************************************************************************/
+
+// Cost of one node in the surface area heuristic, before dividing by the root area.
+static float nodeCost(const LinearBVHNode& node) {
+	float cost = (node.numPrims > 0) ? float(node.numPrims) : TRAVERSAL_COST;
+	return cost * node.bounds().surfaceArea();
+}
+
+float BVH::sahCost() const {
+	if (nodes.empty()) { return 0.f; }
+	return float(costSum / std::max(nodes[0].bounds().surfaceArea(), FLT_MIN));
+}
+
+// Parent links and per-object primitive lists, so that a refit only has to
+// visit what one object touches. Called at the end of either build.
+void BVH::prepareRefit(int numObjects) {
+	parents.assign(nodes.size(), -1);
+	primLeaf.assign(prims.size(), -1);
+	dirty.assign(nodes.size(), 0);
+	costSum = 0.0;
+
+	for (int i = 0; i < nodes.size(); i++) {
+		const LinearBVHNode& node = nodes[i];
+		costSum += nodeCost(node);
+
+		if (node.numPrims > 0) {
+			for (int k = node.offset; k < node.offset + node.numPrims; k++) {
+				primLeaf[k] = i;
+			}
+		}
+		else {
+			parents[i + 1] = i;
+			parents[node.offset] = i;
+		}
+	}
+	builtCost = sahCost();
+
+	objectPrimStart.assign(numObjects + 1, 0);
+	for (int k = 0; k < prims.size(); k++) {
+		objectPrimStart[prims[k].object + 1]++;
+	}
+	for (int i = 0; i < numObjects; i++) {
+		objectPrimStart[i + 1] += objectPrimStart[i];
+	}
+	objectPrims.resize(prims.size());
+	std::vector<int> next(objectPrimStart.begin(), objectPrimStart.end() - 1);
+	for (int k = 0; k < prims.size(); k++) {
+		objectPrims[next[prims[k].object]++] = k;
+	}
+}
+
+bool BVH::refit(const std::vector<Object *>& objs, int object) {
+	refitted.clear();
+	if (object < 0 || object + 1 >= objectPrimStart.size()) { return true; }
+
+	// Re-read the moved primitives and mark their leaves and every ancestor once.
+	for (int n = objectPrimStart[object]; n < objectPrimStart[object + 1]; n++) {
+		int k = objectPrims[n];
+		primitiveBounds(objs, prims[k]);
+		packPrimitive(objs, k);
+
+		for (int node = primLeaf[k]; node >= 0 && !dirty[node]; node = parents[node]) {
+			dirty[node] = 1;
+			refitted.push_back(node);
+		}
+	}
+
+	// Depth-first layout puts every child after its parent, so going from the
+	// highest index down updates children before the parents that read them.
+	std::sort(refitted.begin(), refitted.end(), std::greater<int>());
+
+	for (int r = 0; r < refitted.size(); r++) {
+		LinearBVHNode& node = nodes[refitted[r]];
+		costSum -= nodeCost(node);
+
+		AABB b;
+		if (node.numPrims > 0) {
+			for (int k = node.offset; k < node.offset + node.numPrims; k++) {
+				b.grow(prims[k].bounds);
+			}
+		}
+		else {
+			b.grow(nodes[refitted[r] + 1].bounds());
+			b.grow(nodes[node.offset].bounds());
+		}
+		node.min = b.min;
+		node.max = b.max;
+
+		costSum += nodeCost(node);
+		dirty[refitted[r]] = 0;
+	}
+
+	return sahCost() <= REBUILD_RATIO * builtCost;
+}
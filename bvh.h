@@ -0,0 +1,324 @@
+#pragma once
+#include "Object.h"
+#include "aligned.h"
+#include "batch.h"
+#include "intersect.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <iosfwd>
+#include <vector>
+#include <glm/glm.hpp>
+
+
+const int BVH_STACK_SIZE = 128; // Deeper than either builder can go
+const int INSTANCE_PRIM = -2; // Primitive::triangle of an instanced mesh
+const int BATCH_MIN_PRIMS = 3; // Smaller leaves are cheaper one primitive at a time
+
+class QuantizedMesh;
+
+// Axis-aligned bounding box.
+class AABB {
+public:
+	point3 min = point3(FLT_MAX, FLT_MAX, FLT_MAX);
+	point3 max = point3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	void grow(const point3& p) {
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+	void grow(const AABB& b) {
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+	point3 centroid() const {
+		return 0.5f * (min + max);
+	}
+	float surfaceArea() const {
+		point3 ext = max - min;
+		if (ext.x < 0.f) { return 0.f; } // empty
+		return 2.f * (ext.x * ext.y + ext.y * ext.z + ext.z * ext.x);
+	}
+	int maxExtent() const {
+		point3 ext = max - min;
+		if (ext.x > ext.y && ext.x > ext.z) { return 0; }
+		return (ext.y > ext.z) ? 1 : 2;
+	}
+};
+
+// Something the BVH can bound: a sphere, a single triangle of a mesh, or a
+// whole instanced mesh. Planes are infinite, so they are kept out of the tree.
+class Primitive {
+public:
+	int object;
+	int triangle; // -1 for a sphere, INSTANCE_PRIM for an instanced mesh
+	AABB bounds;
+	point3 centroid;
+};
+
+// Pointer-based node, only used while building.
+class BVHNode {
+public:
+	AABB bounds;
+	BVHNode* children[2] = { NULL, NULL };
+	int firstPrim = 0; // Range in BVH::prims, only meaningful for leaves
+	int numPrims = 0;
+	int axis = 0; // Split axis of interior nodes
+
+	~BVHNode();
+};
+
+// Flattened node, 32 bytes so two share a cache line. Nodes are stored in
+// depth-first order, so the first child of an interior node is the next one.
+class LinearBVHNode {
+public:
+	point3 min;
+	point3 max;
+	int offset; // Leaves: first entry in BVH::packed. Interior: second child
+	unsigned short numPrims; // 0 for interior nodes
+	unsigned char axis;
+	unsigned char pad;
+
+	AABB bounds() const {
+		AABB b;
+		b.min = min;
+		b.max = max;
+		return b;
+	}
+};
+
+// Slab test, limited to hits closer than dist. Ordering t0 and t1 by value
+// compiles to a min and a max, where picking the sides by ray.sign would
+// branch on every axis.
+inline bool intersectBounds(const LinearBVHNode& node, const Ray& ray, float dist) {
+	float tmin = 0.f;
+	float tmax = dist;
+
+	for (int a = 0; a < 3; a++) {
+		float t0 = (node.min[a] - ray.e[a]) * ray.invD[a];
+		float t1 = (node.max[a] - ray.e[a]) * ray.invD[a];
+		if (t0 > t1) { std::swap(t0, t1); }
+		t1 *= 1.00000024f; // Conservative against rounding, see PBRT 3.9.2
+
+		tmin = (t0 > tmin) ? t0 : tmin;
+		tmax = (t1 < tmax) ? t1 : tmax;
+		if (tmin > tmax) { return false; }
+	}
+	return true;
+}
+
+// Leaf primitive data, copied out of the objects in leaf order so that a leaf
+// reads one contiguous run instead of gathering from the mesh arrays.
+// Triangles hold the vertex and edges of TriangleArrays in v0..v2. Spheres use v0 as the centre, v1.x as the radius and v1.y as
+// its square, like the GPU packer. Instances hold the rows of the inverse transform in v0..v2 and its
+// translation in normal.
+class PackedPrimitive {
+public:
+	point3 v0;
+	point3 v1;
+	point3 v2;
+	point3 normal; // Only used by instances
+	int object;
+	int triangle; // -1 for a sphere, INSTANCE_PRIM for an instanced mesh
+};
+
+inline float intersectPacked(const PackedPrimitive& p, const Ray& ray) {
+	if (p.triangle < 0) {
+		return intersectSphere(p.v0, p.v1.y, ray);
+	}
+	return intersectTriangle(p.v0, p.v1, p.v2, ray);
+}
+
+const int MAX_PACKET_RAYS = 64; // An 8x8 tile of pixels
+
+// Primary rays sharing an origin e, for BVH::intersectPacket(). dist, object
+// and triangle start out like the arguments of BVH::intersect() and end up
+// holding each ray's closest hit.
+class RayPacket {
+public:
+	point3 e;
+	int count = 0;
+	Ray rays[MAX_PACKET_RAYS];
+	float dist[MAX_PACKET_RAYS];
+	int object[MAX_PACKET_RAYS];
+	int triangle[MAX_PACKET_RAYS];
+};
+
+// Morton code of a point in the unit cube, 10 bits per axis, as buildLinear() sorts by.
+unsigned int mortonCode30(const point3& p);
+
+// Counters for comparing acceleration structures, compiled in with -DTRAVERSAL_STATS.
+class TraversalStats {
+public:
+	long long rays = 0;
+	long long nodes = 0; // Nodes fetched and box tested
+	long long prims = 0; // Primitive intersection tests
+};
+
+extern TraversalStats traversalStats;
+void printTraversalStats();
+
+#ifdef TRAVERSAL_STATS
+#  define COUNT_STAT(counter, n) (traversalStats.counter += (n))
+#else
+#  define COUNT_STAT(counter, n)
+#endif
+
+// Bounding volume hierarchy over the spheres and mesh triangles of the scene.
+// build() is top-down with the binned surface area heuristic. buildLinear()
+// sorts primitives along a Morton curve instead (Karras 2012), which is much
+// faster to build in parallel but gives a somewhat slower tree.
+// buildSpatial() adds spatial splits to the SAH build (Stich et al. 2009),
+// letting large or overlapping triangles appear in more than one leaf.
+// Instanced meshes are single primitives whose own bottom-level BVH
+// (Mesh::blas) has to be built first, so the scene BVH is the top level.
+class BVH {
+public:
+	std::vector<Primitive> prims;
+	std::vector<LinearBVHNode, AlignedAllocator<LinearBVHNode> > nodes;
+	std::vector<PackedPrimitive, AlignedAllocator<PackedPrimitive> > packed;
+	PrimitiveLanes lanes; // packed again as structure of arrays, for intersectBatch()
+	std::vector<const BVH *> blas; // Per object, the mesh BVH of instances
+	const QuantizedMesh* quantized = NULL; // Set by buildQuantized(), leaves then index its triangles
+
+	// Refit bookkeeping. The packed primitives of object i are
+	// objectPrims[objectPrimStart[i]] up to objectPrims[objectPrimStart[i + 1]].
+	std::vector<int> parents;
+	std::vector<int> primLeaf;
+	std::vector<int> objectPrimStart;
+	std::vector<int> objectPrims;
+	std::vector<int> refitted; // Nodes the last refit changed, children first
+
+	void build(const std::vector<Object *>& objects);
+	void buildLinear(const std::vector<Object *>& objects);
+	void buildSpatial(const std::vector<Object *>& objects, float duplication); // Up to duplication * primitives extra references
+	void clear();
+	void buildQuantized(QuantizedMesh& mesh); // See quantized.cpp
+	bool intersect(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) const; // dist no further than ray.tmax
+	bool intersectLeaf(int first, int count, const Ray& ray,
+					   float& dist, int& indexOfClosest, int& indexOfTriangle) const;
+	void intersectPacket(RayPacket& packet) const; // intersect() for every ray, see packet.cpp
+
+	// Any-hit query for shadow rays: true as soon as anything but the ignored
+	// primitive is hit closer than ray.tmax, in whatever order it is found.
+	bool occluded(const Ray& ray, int ignoreObject, int ignoreTriangle) const;
+	bool occludedLeaf(int first, int count, const Ray& ray, int ignoreObject, int ignoreTriangle) const;
+
+	// Update the bounds above one object that moved, without touching the
+	// topology. Returns false once the tree has degraded enough that it
+	// should be rebuilt instead.
+	bool refit(const std::vector<Object *>& objects, int object);
+	float sahCost() const;
+
+	// Raw copy of a built tree for the on-disk cache, see bvhcache.h.
+	void save(std::ostream& out) const;
+	bool load(const unsigned char*& data, const unsigned char* end, const std::vector<Object *>& objects);
+
+private:
+	float builtCost = 0.f; // sahCost() right after the build
+	double costSum = 0.0; // sahCost() before dividing by the root area
+	std::vector<unsigned char> dirty;
+
+	bool intersectLeafBatch(int first, int count, const Ray& ray,
+							float& dist, int& indexOfClosest, int& indexOfTriangle) const;
+	bool occludedLeafBatch(int first, int count, const Ray& ray, int ignoreObject, int ignoreTriangle) const;
+	bool intersectInstance(const PackedPrimitive& p, const Ray& ray,
+						   float& dist, int& indexOfClosest, int& indexOfTriangle) const;
+	bool occludedInstance(const PackedPrimitive& p, const Ray& ray, int ignoreObject, int ignoreTriangle) const;
+	bool intersectLeafQuantized(int first, int count, const Ray& ray,
+								float& dist, int& indexOfClosest, int& indexOfTriangle) const;
+	bool occludedLeafQuantized(int first, int count, const Ray& ray, int ignoreObject, int ignoreTriangle) const;
+	void gatherPrimitives(const std::vector<Object *>& objects);
+	void primitiveBounds(const std::vector<Object *>& objects, Primitive& prim) const;
+	BVHNode* buildRecursive(int first, int last, int depth);
+	int flatten(const BVHNode* node);
+	void pack(const std::vector<Object *>& objects);
+	void packPrimitive(const std::vector<Object *>& objects, int i);
+	void packLanes(int i);
+	void prepareRefit(int numObjects);
+};
+
+// Instances take the ray into mesh space and carry on down the mesh BVH.
+// The transform is affine and d is not renormalized, so t, tmin and tmax
+// stay the same.
+inline Ray toInstanceSpace(const PackedPrimitive& p, const Ray& ray) {
+	point3 e = point3(glm::dot(p.v0, ray.e), glm::dot(p.v1, ray.e), glm::dot(p.v2, ray.e)) + p.normal;
+	point3 d = point3(glm::dot(p.v0, ray.d), glm::dot(p.v1, ray.d), glm::dot(p.v2, ray.d));
+	return Ray(e, d, ray.tmin, ray.tmax);
+}
+
+// Closest hit in packed[first, first + count), shared with the wide BVHs.
+// Leaves of BATCH_MIN_PRIMS or more go to intersectLeafBatch() when a vector
+// kernel is available.
+inline bool BVH::intersectLeaf(int first, int count, const Ray& ray,
+							   float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	if (quantized != NULL) {
+		return intersectLeafQuantized(first, count, ray, dist, indexOfClosest, indexOfTriangle);
+	}
+	if (count >= BATCH_MIN_PRIMS && batchKernel() != BATCH_SCALAR) {
+		return intersectLeafBatch(first, count, ray, dist, indexOfClosest, indexOfTriangle);
+	}
+
+	bool hit = false;
+	COUNT_STAT(prims, count);
+
+	for (int i = first; i < first + count; i++) {
+		const PackedPrimitive& p = packed[i];
+
+		if (p.triangle == INSTANCE_PRIM) {
+			hit |= intersectInstance(p, ray, dist, indexOfClosest, indexOfTriangle);
+			continue;
+		}
+
+		float t = intersectPacked(p, ray);
+		if (t < dist) {
+			dist = t;
+			indexOfClosest = p.object;
+			indexOfTriangle = p.triangle;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+inline bool BVH::occludedLeaf(int first, int count, const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	if (quantized != NULL) {
+		return occludedLeafQuantized(first, count, ray, ignoreObject, ignoreTriangle);
+	}
+	if (count >= BATCH_MIN_PRIMS && batchKernel() != BATCH_SCALAR) {
+		return occludedLeafBatch(first, count, ray, ignoreObject, ignoreTriangle);
+	}
+
+	COUNT_STAT(prims, count);
+
+	for (int i = first; i < first + count; i++) {
+		const PackedPrimitive& p = packed[i];
+
+		if (p.triangle == INSTANCE_PRIM) {
+			if (occludedInstance(p, ray, ignoreObject, ignoreTriangle)) { return true; }
+			continue;
+		}
+
+		if (p.object == ignoreObject && p.triangle == ignoreTriangle) { continue; }
+		if (intersectPacked(p, ray) < ray.tmax) { return true; }
+	}
+	return false;
+}
+
+inline bool BVH::intersectInstance(const PackedPrimitive& p, const Ray& ray,
+								   float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	int object = -1;
+	int triangle = -1;
+
+	if (blas[p.object]->intersect(toInstanceSpace(p, ray), dist, object, triangle)) {
+		indexOfClosest = p.object;
+		indexOfTriangle = triangle;
+		return true;
+	}
+	return false;
+}
+
+inline bool BVH::occludedInstance(const PackedPrimitive& p, const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	// Inside the mesh BVH every triangle belongs to object 0.
+	return blas[p.object]->occluded(toInstanceSpace(p, ray), (p.object == ignoreObject) ? 0 : -1, ignoreTriangle);
+}
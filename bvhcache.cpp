@@ -0,0 +1,274 @@
+#include "bvhcache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+const unsigned int CACHE_VERSION = 3; // Bump whenever the layout or a builder changes
+const char CACHE_MAGIC[8] = { 'R', 'T', 'B', 'V', 'H', 'C', 'H', 'E' };
+
+// Start of the file. layout packs the sizes of the stored classes, so a
+// file written by a differently laid out build is rejected.
+class CacheHeader {
+public:
+	char magic[8];
+	unsigned int version;
+	unsigned int layout;
+	unsigned long long key;
+	unsigned int numTrees; // The scene BVH, then one per mesh
+	unsigned int pad;
+};
+
+static unsigned int cacheLayout() {
+	return unsigned(sizeof(Primitive)) | unsigned(sizeof(LinearBVHNode)) << 8 | unsigned(sizeof(PackedPrimitive)) << 16;
+}
+
+
+/****************************************************************************/
+
+// FNV-1a, eight bytes a step with an extra shift to mix the high bits down.
+unsigned long long hashBytes(const void* data, size_t size, unsigned long long hash) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	size_t i = 0;
+
+	for (; i + 8 <= size; i += 8) {
+		unsigned long long word;
+		memcpy(&word, bytes + i, 8);
+		hash = (hash ^ word) * 1099511628211ull;
+		hash ^= hash >> 32;
+	}
+	for (; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// Read-only mapping of a whole file.
+class MappedFile {
+public:
+	const unsigned char* data = NULL;
+	size_t size = 0;
+
+	bool open(const std::string& path);
+	~MappedFile();
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+};
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path) {
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) { return false; }
+
+	LARGE_INTEGER length;
+	if (!GetFileSizeEx(file, &length) || length.QuadPart == 0) { return false; }
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) { return false; }
+
+	data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	size = (data != NULL) ? size_t(length.QuadPart) : 0;
+	return data != NULL;
+}
+
+MappedFile::~MappedFile() {
+	if (data != NULL) { UnmapViewOfFile(data); }
+	if (mapping != NULL) { CloseHandle(mapping); }
+	if (file != INVALID_HANDLE_VALUE) { CloseHandle(file); }
+}
+
+#else
+
+bool MappedFile::open(const std::string& path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) { return false; }
+
+	struct stat info;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		void* mapped = mmap(NULL, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED) {
+			data = (const unsigned char*)mapped;
+			size = size_t(info.st_size);
+		}
+	}
+	close(fd); // The mapping stays valid
+	return data != NULL;
+}
+
+MappedFile::~MappedFile() {
+	if (data != NULL) { munmap((void*)data, size); }
+}
+
+#endif
+
+/****************************************************************************/
+
+template <typename T>
+static void writeArray(std::ostream& out, const T* items, size_t count) {
+	out.write((const char*)items, std::streamsize(count * sizeof(T)));
+}
+
+template <typename T>
+static bool readArray(const unsigned char*& data, const unsigned char* end, T* items, size_t count) {
+	if (size_t(end - data) / sizeof(T) < count) { return false; }
+	memcpy((void*)items, data, count * sizeof(T));
+	data += count * sizeof(T);
+	return true;
+}
+
+void BVH::save(std::ostream& out) const {
+	unsigned long long counts[2] = { prims.size(), nodes.size() };
+	writeArray(out, counts, 2);
+	writeArray(out, prims.data(), prims.size());
+	writeArray(out, nodes.data(), nodes.size());
+	writeArray(out, packed.data(), packed.size());
+}
+
+// Copy a saved tree out of the mapped file. Everything that indexes
+// something else is checked, so a damaged file is rejected rather than
+// traversed.
+bool BVH::load(const unsigned char*& data, const unsigned char* end, const std::vector<Object *>& objs) {
+	clear();
+
+	unsigned long long counts[2];
+	if (!readArray(data, end, counts, 2)) { return false; }
+	if (counts[0] > size_t(end - data) || counts[1] > size_t(end - data)) { return false; }
+
+	prims.resize(counts[0]);
+	nodes.resize(counts[1]);
+	packed.resize(counts[0]);
+	bool valid = readArray(data, end, prims.data(), prims.size()) &&
+		readArray(data, end, nodes.data(), nodes.size()) &&
+		readArray(data, end, packed.data(), packed.size());
+
+	for (int i = 0; valid && i < nodes.size(); i++) {
+		const LinearBVHNode& node = nodes[i];
+		if (node.numPrims > 0) {
+			valid = node.offset >= 0 && size_t(node.offset) + node.numPrims <= prims.size();
+		}
+		else {
+			valid = i + 1 < nodes.size() && node.offset > i && size_t(node.offset) < nodes.size();
+		}
+	}
+
+	blas.assign(objs.size(), NULL);
+	for (int k = 0; valid && k < prims.size(); k++) {
+		const Primitive& prim = prims[k];
+		valid = prim.object >= 0 && prim.object < objs.size() &&
+			packed[k].object == prim.object && packed[k].triangle == prim.triangle;
+		if (!valid) { break; }
+
+		const Object* object = objs[prim.object];
+		if (prim.triangle == INSTANCE_PRIM) {
+			valid = object->instanced && object->mesh->blas != NULL;
+			blas[prim.object] = object->mesh->blas;
+		}
+		else if (prim.triangle < 0) {
+			valid = object->type == SPHERE;
+		}
+		else {
+			valid = object->type == MESH && !object->instanced && prim.triangle < object->mesh->tris.size();
+		}
+	}
+
+	if (!valid) {
+		clear();
+		return false;
+	}
+	lanes.resize(packed.size());
+	for (int k = 0; k < packed.size(); k++) {
+		packLanes(k);
+	}
+	prepareRefit(objs.size());
+	return true;
+}
+
+/****************************************************************************/
+
+bool loadBVHCache(const std::string& path, unsigned long long key, BVH& bvh,
+				  const std::vector<Object *>& objects, const std::vector<Mesh *>& meshes) {
+	MappedFile file;
+	if (!file.open(path) || file.size < sizeof(CacheHeader)) { return false; }
+
+	CacheHeader header;
+	memcpy(&header, file.data, sizeof(header));
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION ||
+		header.layout != cacheLayout() || header.key != key || header.numTrees != meshes.size() + 1) {
+		return false;
+	}
+
+	const unsigned char* data = file.data + sizeof(header);
+	const unsigned char* end = file.data + file.size;
+	bool valid = true;
+
+	// Mesh BVHs first, since the scene BVH checks its instances against them.
+	for (int m = 0; m < meshes.size(); m++) {
+		Object local(MESH);
+		local.mesh = meshes[m];
+		delete meshes[m]->blas;
+		meshes[m]->blas = new BVH();
+		valid = valid && meshes[m]->blas->load(data, end, std::vector<Object *>(1, &local));
+	}
+	valid = valid && bvh.load(data, end, objects);
+
+	if (!valid) {
+		for (int m = 0; m < meshes.size(); m++) {
+			delete meshes[m]->blas;
+			meshes[m]->blas = NULL;
+		}
+	}
+	return valid;
+}
+
+// Written to a temporary file and renamed, so that another process starting
+// on the same scene never maps a half written cache. Several processes may
+// save the same scene at once, so each writer has its own temporary file.
+bool saveBVHCache(const std::string& path, unsigned long long key, const BVH& bvh, const std::vector<Mesh *>& meshes) {
+	std::string temp = path + ".tmp" + std::to_string(std::random_device()());
+	std::ofstream out(temp.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) { return false; }
+
+	CacheHeader header;
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.layout = cacheLayout();
+	header.key = key;
+	header.numTrees = meshes.size() + 1;
+	header.pad = 0;
+	out.write((const char*)&header, sizeof(header));
+
+	for (int m = 0; m < meshes.size(); m++) {
+		meshes[m]->blas->save(out);
+	}
+	bvh.save(out);
+	out.close();
+
+	if (out.fail()) {
+		std::remove(temp.c_str());
+		return false;
+	}
+	if (std::rename(temp.c_str(), path.c_str()) != 0) {
+		std::remove(path.c_str()); // Windows will not rename over an existing file
+		if (std::rename(temp.c_str(), path.c_str()) != 0) {
+			std::remove(temp.c_str());
+			return false;
+		}
+	}
+	return true;
+}
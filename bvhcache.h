@@ -0,0 +1,16 @@
+#pragma once
+#include "bvh.h"
+
+#include <string>
+
+
+// Built BVHs are saved next to the scene file (scenes/c.json -> scenes/c.bvh)
+// and mapped back in on the next launch, as long as the key still matches.
+// The caller makes the key from everything the build depends on: the
+// geometry, the builder and its settings.
+unsigned long long hashBytes(const void* data, size_t size, unsigned long long hash = 14695981039346656037ull);
+
+// meshes are the ones with a bottom-level BVH, in the same order for both calls.
+bool loadBVHCache(const std::string& path, unsigned long long key, BVH& bvh,
+				  const std::vector<Object *>& objects, const std::vector<Mesh *>& meshes);
+bool saveBVHCache(const std::string& path, unsigned long long key, const BVH& bvh, const std::vector<Mesh *>& meshes);
@@ -1,6 +1,9 @@
 // Based on: http://www.cs.unm.edu/~angel/BOOK/INTERACTIVE_COMPUTER_GRAPHICS/SIXTH_EDITION/CODE/CHAPTER03/WINDOWS_VERSIONS/example2.cpp
 // Modified to isolate the main program and use GLM
 
+#ifdef HEADLESS // The render binary is built without OpenGL, see render.cpp
+#include <glm/glm.hpp>
+#else
 #include <GL/glew.h>
 #ifdef __APPLE__  // include Mac OS X verions of headers
 #  include <OpenGL/gl.h>
@@ -19,6 +22,7 @@
 #define BUFFER_OFFSET( offset )   ((GLvoid*) (offset))
 
 extern GLuint InitShader(const char* vShaderFile, const char* fShaderFile);
+#endif  // HEADLESS
 
 // Implement the following...
 
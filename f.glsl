@@ -21,7 +21,7 @@ void getAliasOffset(int index, inout float x, inout float y);
 void debugRed();
 void debugViewRect(float xPos, float yPos);
 bool getIntersection(vec3 e, vec3 d, inout float dist, inout int indexOfClosest, inout int indexOfTriangle);
-bool testIntersectionWithObject(int i, vec3 e, vec3 d, inout float dist, inout int indexOfClosest, inout int indexOfTriangle);
+bool testIntersectionWithObject(int i, vec3 e, vec3 d, vec3 dir, float invLength, inout float dist, inout int indexOfClosest, inout int indexOfTriangle);
 vec3 getShadowAmount(vec3 P, int lid, vec3 lightPos, vec3 L);
 bool determineLightDirection(vec3 P, int lid, inout vec3 L, inout vec3 lightPos);
 vec3 phongIllumination(vec3 e, vec3 d, int oid, int lid, vec3 N, vec3 L, vec3 V, vec3 P);
@@ -30,6 +30,8 @@ vec3 calcReflection(int indexOfClosest, vec3 P, vec3 N, vec3 V);
 vec3 calcTransmission(int indexOfClosest, vec3 P, vec3 N, vec3 V);
 vec3 calcRefraction(int indexOfClosest, vec3 P, vec3 N, vec3 V);
 float calcPlaneDistance(vec3 A, vec3 N, vec3 d, vec3 e);
+float intersectSphere(vec3 pos, float r2, vec3 e, vec3 dir, float invLength);
+float intersectTriangle(vec3 A, vec3 E1, vec3 E2, vec3 e, vec3 d);
 float acneThreshold(vec3 N, vec3 d);
 void initNewRay(vec3 e, vec3 D, bool outside, vec3 effectiveness, int indexOfClosest);
 vec3 sumOutputColour();
@@ -178,7 +180,8 @@ bool trace() {
 	}
 	else {
 		int oind = rays[currRay].objectIndex;
-		hit = testIntersectionWithObject(oind, e, D, dist, indexOfClosest, indexOfTriangle);
+		float invLength = inversesqrt(dot(D, D));
+		hit = testIntersectionWithObject(oind, e, D, D * invLength, invLength, dist, indexOfClosest, indexOfTriangle);
 	}
 
 	if (SHOW_LIGHTS) {
@@ -256,17 +259,20 @@ vec3 sumOutputColour() {
 
 
 bool getIntersection(vec3 e, vec3 d, inout float dist, inout int indexOfClosest, inout int indexOfTriangle) {
+	// Normalized once here rather than for every sphere
+	float invLength = inversesqrt(dot(d, d));
+	vec3 dir = d * invLength;
 
 	for (int i = 0; i < NUM_OBJECTS; i++) {
 		if (i == numObjects) { break; }
 		
-        testIntersectionWithObject(i, e, d, dist, indexOfClosest, indexOfTriangle);
+        testIntersectionWithObject(i, e, d, dir, invLength, dist, indexOfClosest, indexOfTriangle);
 	}
 
 	return (indexOfClosest >= 0);
 }
 
-bool testIntersectionWithObject(int i, vec3 e, vec3 d, inout float dist, inout int indexOfClosest, inout int indexOfTriangle) {
+bool testIntersectionWithObject(int i, vec3 e, vec3 d, vec3 dir, float invLength, inout float dist, inout int indexOfClosest, inout int indexOfTriangle) {
 	int oid = objectIds[i];
 	int objectType = int(geometry[oid].r);
 
@@ -282,24 +288,12 @@ bool testIntersectionWithObject(int i, vec3 e, vec3 d, inout float dist, inout i
 			pos = pos4.xyz;
 		}
 
-		vec3 emc = e - pos;
-		float r = float(geometry[oid].b);
+		float r2 = float(geometry[oid].g);
+		float t = intersectSphere(pos, r2, e, dir, invLength);
 
-		float discriminant = dot(d, emc) * dot(d, emc) - dot(d, d) * (dot(emc, emc) - r * r);
-		float t = FLT_MAX;
-
-		if (discriminant >= 0.f) {
-			// One or two intersections, I don't think I care which.
-			float t1 = (dot(-d, emc) + sqrt(discriminant)) / dot(d, d);
-			float t2 = (dot(-d, emc) - sqrt(discriminant)) / dot(d, d);
-			t1 = (t1 > ANTI_ACNE) ? t1 : FLT_MAX;
-			t2 = (t2 > ANTI_ACNE) ? t2 : FLT_MAX;
-			t = min(t1, t2);
-
-			if (t < dist) {
-				dist = t;
-				indexOfClosest = i;
-			}
+		if (t < dist) {
+			dist = t;
+			indexOfClosest = i;
 		}
 	}
 	else if (objectType == 1) {
@@ -324,25 +318,18 @@ bool testIntersectionWithObject(int i, vec3 e, vec3 d, inout float dist, inout i
 			int tid = oid + 4 + (j * 4); // Triange id
 
 			vec3 A = geometry[tid + 0];
-			vec3 B = geometry[tid + 1];
-			vec3 C = geometry[tid + 2];
-			vec3 N = geometry[tid + 3];
+			vec3 E1 = geometry[tid + 1];
+			vec3 E2 = geometry[tid + 2];
 
 			if (i == spinningObject) {
 				A = (SpinTrans * vec4(A.x, A.y, A.z, 1)).xyz;
-				B = (SpinTrans * vec4(B.x, B.y, B.z, 1)).xyz;
-				C = (SpinTrans * vec4(C.x, C.y, C.z, 1)).xyz;
-				N = cross(B - A, C - A);
+				E1 = (SpinTrans * vec4(E1.x, E1.y, E1.z, 0)).xyz;
+				E2 = (SpinTrans * vec4(E2.x, E2.y, E2.z, 0)).xyz;
 			}
 
-			float t = calcPlaneDistance(A, N, d, e);
-			vec3 X = e + (t * d);
+			float t = intersectTriangle(A, E1, E2, e, d);
 
-			float inA = dot(cross(B - A, X - A), N);
-			float inB = dot(cross(C - B, X - B), N);
-			float inC = dot(cross(A - C, X - C), N);
-
-			if (t > acneThreshold(N, d) && inA > 0.f && inB > 0.f && inC > 0.f) { // hit front of triangle
+			if (t < FLT_MAX) {
 				if (t < dist) {
 					dist = t;
 					indexOfClosest = i;
@@ -380,7 +367,7 @@ vec3 getShadowAmount(vec3 P, int lid, vec3 lightPos, vec3 L) {
 				int indexTriL = -1;
 				
 				// test every object for intersection
-				if(testIntersectionWithObject(i, P, shadowRay, maxDist, indexObjL, indexTriL)) {
+				if(testIntersectionWithObject(i, P, shadowRay, shadowRay, 1.0, maxDist, indexObjL, indexTriL)) {
 					int matid = int(geometry[oid + 1].r);
 					vec3 transmission = materials[matid + 4];
 					throughLight = throughLight * transmission;
@@ -424,7 +411,7 @@ vec3 getShadowAmount(vec3 P, int lid, vec3 lightPos, vec3 L) {
 					int indexTriL = -1;
 					
 					// test every object for intersection
-					if(testIntersectionWithObject(i, P, shadowRay, maxDist, indexObjL, indexTriL)) {
+					if(testIntersectionWithObject(i, P, shadowRay, shadowRay, 1.0, maxDist, indexObjL, indexTriL)) {
 						int matid = int(geometry[oid + 1].r);
 						vec3 transmission = materials[matid + 4];
 						lightPortion = lightPortion * transmission;
@@ -684,13 +671,11 @@ vec3 calcNormal(int oid, vec3 P, int indexOfTriangle) {
 		N = normalize(geometry[tid + 3]);
 
 		if (spinningObject >= 0 && oid == objectIds[spinningObject]) {
-			vec3 A = geometry[tid + 0];
-			vec3 B = geometry[tid + 1];
-			vec3 C = geometry[tid + 2];
-			A = (SpinTrans * vec4(A.x, A.y, A.z, 1)).xyz;
-			B = (SpinTrans * vec4(B.x, B.y, B.z, 1)).xyz;
-			C = (SpinTrans * vec4(C.x, C.y, C.z, 1)).xyz;
-			N = normalize(cross(B - A, C - A));
+			vec3 E1 = geometry[tid + 1];
+			vec3 E2 = geometry[tid + 2];
+			E1 = (SpinTrans * vec4(E1.x, E1.y, E1.z, 0)).xyz;
+			E2 = (SpinTrans * vec4(E2.x, E2.y, E2.z, 0)).xyz;
+			N = normalize(cross(E1, E2));
 		}
 	}
 	return N;
@@ -713,6 +698,43 @@ float calcPlaneDistance(vec3 A, vec3 N, vec3 d, vec3 e) {
 	return t;
 }
 
+// Same as intersectSphere() in intersect.h: dir is d normalized and hits
+// come back as t along d.
+float intersectSphere(vec3 pos, float r2, vec3 e, vec3 dir, float invLength) {
+	vec3 f = e - pos;
+	float b = dot(f, dir); // Half of b
+	float c = dot(f, f) - r2;
+	float discriminant = b * b - c;
+	if (discriminant < 0.f) { return FLT_MAX; }
+
+	float root = sqrt(discriminant);
+	float t1 = (-b - root) * invLength;
+	float t2 = (-b + root) * invLength;
+	t1 = (t1 > ANTI_ACNE) ? t1 : FLT_MAX;
+	t2 = (t2 > ANTI_ACNE) ? t2 : FLT_MAX;
+	return min(t1, t2);
+}
+
+// Moller-Trumbore, as in intersect.h. E1 and E2 are the edges leaving A.
+float intersectTriangle(vec3 A, vec3 E1, vec3 E2, vec3 e, vec3 d) {
+	vec3 p = cross(d, E2);
+	float det = dot(E1, p);
+	if (det == 0.f) { return FLT_MAX; }
+
+	float invDet = 1.f / det;
+	vec3 s = e - A;
+	float u = dot(s, p) * invDet;
+	if (u < 0.f || u > 1.f) { return FLT_MAX; }
+
+	vec3 q = cross(s, E1);
+	float v = dot(d, q) * invDet;
+	if (v < 0.f || u + v > 1.f) { return FLT_MAX; }
+
+	float t = dot(E2, q) * invDet;
+	float threshold = (det < 0.f) ? ANTI_ACNE / -det : ANTI_ACNE; // det is -dot(N, d)
+	return (t > threshold) ? t : FLT_MAX;
+}
+
 float acneThreshold(vec3 N, vec3 d) {
 	float acneThreshold = ANTI_ACNE;
 	float angleOfIncidenceCos = dot(N, d);
@@ -0,0 +1,186 @@
+#include "grid.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+const float CELLS_PER_PRIM = 3.f; // Target density, as in PBRT's grid
+const int MAX_RESOLUTION = 256; // Cells along any one axis
+
+
+/****************************************************************************/
+
+void UniformGrid::clear() {
+	bounds = AABB();
+	res[0] = res[1] = res[2] = 0;
+	cellStart.clear();
+	cellPrims.clear();
+	binary = NULL;
+}
+
+// Cells overlapped by b, inclusive.
+void UniformGrid::cellRange(const AABB& b, int lo[3], int hi[3]) const {
+	for (int a = 0; a < 3; a++) {
+		lo[a] = std::min(std::max(int((b.min[a] - bounds.min[a]) * invCellSize[a]), 0), res[a] - 1);
+		hi[a] = std::min(std::max(int((b.max[a] - bounds.min[a]) * invCellSize[a]), 0), res[a] - 1);
+	}
+}
+
+// The resolution comes from the object density: about CELLS_PER_PRIM cells
+// per primitive, shaped like the scene bounds so the cells stay close to cubes.
+void UniformGrid::build(const BVH& bvh) {
+	clear();
+	binary = &bvh;
+	int n = bvh.prims.size();
+	if (n == 0) { return; }
+
+	for (int i = 0; i < n; i++) {
+		bounds.grow(bvh.prims[i].bounds);
+	}
+	point3 extent = bounds.max - bounds.min;
+	float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+	float volume = std::max(extent.x, maxExtent * 1e-3f) * std::max(extent.y, maxExtent * 1e-3f) * std::max(extent.z, maxExtent * 1e-3f);
+	float cellsPerUnit = std::cbrt(CELLS_PER_PRIM * n / std::max(volume, FLT_MIN));
+
+	int numCells = 1;
+	for (int a = 0; a < 3; a++) {
+		res[a] = std::min(std::max(int(std::ceil(extent[a] * cellsPerUnit)), 1), MAX_RESOLUTION);
+		cellSize[a] = std::max(extent[a] / res[a], FLT_MIN);
+		invCellSize[a] = (extent[a] > 0.f) ? res[a] / extent[a] : 0.f;
+		numCells *= res[a];
+	}
+
+	// Count the entries of each cell, prefix sum, then fill. Primitives are
+	// added in packed order, so every cell lists them in increasing index.
+	cellStart.assign(numCells + 1, 0);
+	std::vector<int> lo(3 * n);
+	std::vector<int> hi(3 * n);
+	parallelFor(0, n, [&](int i) {
+		cellRange(bvh.prims[i].bounds, &lo[3 * i], &hi[3 * i]);
+	});
+
+	for (int i = 0; i < n; i++) {
+		const int* l = &lo[3 * i];
+		const int* h = &hi[3 * i];
+		for (int z = l[2]; z <= h[2]; z++) {
+			for (int y = l[1]; y <= h[1]; y++) {
+				for (int x = l[0]; x <= h[0]; x++) {
+					cellStart[(z * res[1] + y) * res[0] + x + 1]++;
+				}
+			}
+		}
+	}
+	for (int c = 0; c < numCells; c++) {
+		cellStart[c + 1] += cellStart[c];
+	}
+
+	cellPrims.resize(cellStart[numCells]);
+	std::vector<int> next(cellStart.begin(), cellStart.end() - 1);
+	for (int i = 0; i < n; i++) {
+		const int* l = &lo[3 * i];
+		const int* h = &hi[3 * i];
+		for (int z = l[2]; z <= h[2]; z++) {
+			for (int y = l[1]; y <= h[1]; y++) {
+				for (int x = l[0]; x <= h[0]; x++) {
+					cellPrims[next[(z * res[1] + y) * res[0] + x]++] = i;
+				}
+			}
+		}
+	}
+}
+
+/****************************************************************************/
+
+// Clip the ray to the grid, then step from cell to cell in the order the ray
+// crosses them, handing each cell to visit until it returns true. maxDist is
+// read again after every cell, so visit may shorten it.
+template <typename Visit>
+void UniformGrid::walk(const Ray& ray, const float& maxDist, Visit visit) const {
+	const point3& e = ray.e;
+	const point3& d = ray.d;
+	const point3& invD = ray.invD;
+	float tEnter = 0.f;
+	float tExit = maxDist;
+	for (int a = 0; a < 3; a++) {
+		float t0 = (bounds.min[a] - e[a]) * invD[a];
+		float t1 = (bounds.max[a] - e[a]) * invD[a];
+		if (t0 > t1) { std::swap(t0, t1); }
+		t1 *= 1.00000024f; // Conservative against rounding, as in the BVH slab test
+
+		tEnter = (t0 > tEnter) ? t0 : tEnter;
+		tExit = (t1 < tExit) ? t1 : tExit;
+		if (tEnter > tExit) { return; }
+	}
+
+	int cell[3];
+	int step[3];
+	float tNext[3]; // Distance at which the ray leaves the current cell along each axis
+	float tDelta[3];
+	point3 p = e + tEnter * d;
+
+	for (int a = 0; a < 3; a++) {
+		cell[a] = std::min(std::max(int((p[a] - bounds.min[a]) * invCellSize[a]), 0), res[a] - 1);
+
+		if (d[a] > 0.f) {
+			step[a] = 1;
+			tNext[a] = (bounds.min[a] + (cell[a] + 1) * cellSize[a] - e[a]) * invD[a];
+			tDelta[a] = cellSize[a] * invD[a];
+		}
+		else if (d[a] < 0.f) {
+			step[a] = -1;
+			tNext[a] = (bounds.min[a] + cell[a] * cellSize[a] - e[a]) * invD[a];
+			tDelta[a] = -cellSize[a] * invD[a];
+		}
+		else {
+			step[a] = 0;
+			tNext[a] = FLT_MAX;
+			tDelta[a] = FLT_MAX;
+		}
+	}
+
+	while (true) {
+		COUNT_STAT(nodes, 1);
+		if (visit((cell[2] * res[1] + cell[1]) * res[0] + cell[0])) { break; }
+
+		int axis = (tNext[0] < tNext[1]) ? ((tNext[0] < tNext[2]) ? 0 : 2) : ((tNext[1] < tNext[2]) ? 1 : 2);
+		if (tNext[axis] > maxDist || tNext[axis] > tExit) { break; }
+
+		cell[axis] += step[axis];
+		if (cell[axis] < 0 || cell[axis] >= res[axis]) { break; }
+		tNext[axis] += tDelta[axis];
+	}
+}
+
+// A hit found in a cell may lie further on, in a cell that primitive also
+// covers, so the walk only stops once the next cell starts beyond the
+// closest hit.
+bool UniformGrid::intersect(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	if (cellPrims.empty()) { return false; }
+	COUNT_STAT(rays, 1);
+
+	bool hit = false;
+	dist = std::min(dist, ray.tmax);
+	walk(ray, dist, [&](int c) {
+		for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+			hit |= binary->intersectLeaf(cellPrims[k], 1, ray, dist, indexOfClosest, indexOfTriangle);
+		}
+		return false;
+	});
+	return hit;
+}
+
+// Any hit short of maxDist will do, wherever it lies, so the walk ends in
+// the first cell that has one.
+bool UniformGrid::occluded(const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	if (cellPrims.empty()) { return false; }
+	COUNT_STAT(rays, 1);
+
+	bool hit = false;
+	walk(ray, ray.tmax, [&](int c) {
+		for (int k = cellStart[c]; k < cellStart[c + 1] && !hit; k++) {
+			hit = binary->occludedLeaf(cellPrims[k], 1, ray, ignoreObject, ignoreTriangle);
+		}
+		return hit;
+	});
+	return hit;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "bvh.h"
+
+
+// Uniform grid over the primitives of a BVH, walked with the 3D-DDA of
+// Amanatides and Woo, "A Fast Voxel Traversal Algorithm for Ray Tracing" (1987).
+// Suits scenes of many similar, evenly spread primitives such as particle
+// clouds of spheres, where it does far less work per ray than a tree.
+// Cells list indices into the packed primitives of the BVH it was built from,
+// so that one has to stay alive. A primitive is listed in every cell its
+// bounds overlap.
+class UniformGrid {
+public:
+	AABB bounds;
+	int res[3] = { 0, 0, 0 }; // Cells along each axis
+	point3 cellSize;
+	point3 invCellSize;
+	std::vector<int> cellStart; // Cell c lists cellPrims[cellStart[c]] up to cellPrims[cellStart[c + 1]]
+	std::vector<int> cellPrims;
+	const BVH* binary = NULL;
+
+	void build(const BVH& bvh);
+	void clear();
+	bool intersect(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) const;
+	bool occluded(const Ray& ray, int ignoreObject, int ignoreTriangle) const; // See BVH::occluded()
+
+private:
+	void cellRange(const AABB& b, int lo[3], int hi[3]) const;
+	template <typename Visit>
+	void walk(const Ray& ray, const float& maxDist, Visit visit) const;
+};
@@ -0,0 +1,122 @@
+#pragma once
+#include "Object.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <glm/glm.hpp>
+
+const float ANTI_ACNE = 0.001f;
+
+/****************************************************************************/
+
+// A ray from e along d, with everything the tests below need worked out once
+// when it is made: the unit direction and 1 / |d| for spheres, 1 / d and
+// which way it points on each axis for slab tests. Hits are reported as t
+// along d and only count between tmin and tmax. tmin keeps a surface from
+// hitting the rays leaving it, and is scaled up for surfaces seen from
+// behind, see acneThreshold().
+class Ray {
+public:
+	point3 e;
+	point3 d;
+	point3 dir; // d normalized
+	point3 invD;
+	int sign[3]; // 1 where invD is negative, so slab tests can pick the near side without comparing
+	float invLength; // 1 / |d|
+	float tmin;
+	float tmax;
+
+	Ray() {}
+	Ray(const point3& origin, const point3& direction, float minDist = ANTI_ACNE, float maxDist = FLT_MAX) {
+		e = origin;
+		d = direction;
+		invLength = 1.f / glm::sqrt(glm::dot(d, d));
+		dir = d * invLength;
+		invD = 1.f / d;
+		for (int a = 0; a < 3; a++) {
+			sign[a] = invD[a] < 0;
+		}
+		tmin = minDist;
+		tmax = maxDist;
+	}
+};
+
+/****************************************************************************/
+
+// Ray-primitive tests shared by the flat object loop and the BVH leaves.
+// Each returns the distance along d to the hit, or FLT_MAX on a miss.
+
+
+inline float calcPlaneDistance(const point3& A, const point3& N, const Ray& ray) {
+	float denom = glm::dot(N, ray.d);
+	float t = 0.f;
+
+	if (denom > 0) {
+		t = glm::dot(N, A - ray.e) / denom;
+	}
+	if (denom < 0) {
+		t = glm::dot(N, A - ray.e) / denom;
+	}
+	return t;
+}
+
+inline float acneThreshold(const point3& N, const Ray& ray) {
+	float acneThreshold = ray.tmin;
+	float angleOfIncidenceCos = glm::dot(N, ray.d);
+
+	if (angleOfIncidenceCos > 0) {
+		acneThreshold = ray.tmin / angleOfIncidenceCos;
+	}
+
+	return acneThreshold;
+}
+
+// Sphere of squared radius r2. With a unit direction the quadratic has
+// a = 1 and, taking half of b, the roots are -b +- sqrt(b * b - c): one
+// square root and no division. Both roots are kept, as rays starting inside
+// a sphere need the far one.
+inline float intersectSphere(const point3& centre, float r2, const Ray& ray) {
+	point3 f = ray.e - centre;
+	float b = glm::dot(f, ray.dir); // Half of b
+	float c = glm::dot(f, f) - r2;
+	float discriminant = b * b - c;
+	if (discriminant < 0.f) { return FLT_MAX; }
+
+	float root = glm::sqrt(discriminant);
+	float t1 = (-b - root) * ray.invLength;
+	float t2 = (-b + root) * ray.invLength;
+	t1 = (t1 > ray.tmin) ? t1 : FLT_MAX;
+	t2 = (t2 > ray.tmin) ? t2 : FLT_MAX;
+	return std::min(t1, t2);
+}
+
+inline float intersectPlane(const point3& A, const point3& N, const Ray& ray) {
+	float t = calcPlaneDistance(A, N, ray);
+
+	return (t > acneThreshold(N, ray)) ? t : FLT_MAX;
+}
+
+// Moller and Trumbore, "Fast, Minimum Storage Ray/Triangle Intersection" (1997),
+// on the vertex and edges stored by TriangleArrays. Both sides count. The edge
+// tests include the boundary, so a ray through an edge shared by two
+// triangles hits at least one of them.
+inline float intersectTriangle(const point3& v0, const point3& edge1, const point3& edge2, const Ray& ray) {
+	point3 p = glm::cross(ray.d, edge2);
+	float det = glm::dot(edge1, p);
+	if (det == 0.f) { return FLT_MAX; } // Parallel to the triangle
+
+	float invDet = 1.f / det;
+	point3 s = ray.e - v0;
+	float u = glm::dot(s, p) * invDet;
+	if (u < 0.f || u > 1.f) { return FLT_MAX; }
+
+	point3 q = glm::cross(s, edge1);
+	float v = glm::dot(ray.d, q) * invDet;
+	if (v < 0.f || u + v > 1.f) { return FLT_MAX; }
+
+	// det is -dot(N, d) for N = edge1 x edge2, which gives the same acne
+	// threshold as acneThreshold() without the normal.
+	float t = glm::dot(edge2, q) * invDet;
+	float threshold = (det < 0.f) ? ray.tmin / -det : ray.tmin;
+	return (t > threshold) ? t : FLT_MAX;
+}
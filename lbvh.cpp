@@ -0,0 +1,282 @@
+// Linear BVH build: sort primitive centroids along a Morton curve and emit
+// the hierarchy from the sorted keys, following Karras, "Maximizing Parallelism
+// in the Construction of BVHs, Octrees, and k-d Trees" (HPG 2012).
+// Every step is a parallel loop, only the final depth-first layout is serial.
+
+#include "bvh.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#ifdef _MSC_VER
+#  include <intrin.h>
+#endif
+
+const int MAX_LEAF_PRIMS = 4;
+const int LONG_KEYS_ABOVE = 1 << 20; // 10 bits per axis stops separating primitives
+
+
+/****************************************************************************/
+
+// Spread the low 10 bits of v out so there are two zero bits between each.
+static unsigned int expandBits10(unsigned int v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// Spread the low 21 bits of v out the same way.
+static unsigned long long expandBits21(unsigned long long v) {
+	v &= 0x1FFFFFull;
+	v = (v | (v << 32)) & 0x001F00000000FFFFull;
+	v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+	v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+	v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+	return v;
+}
+
+// 30 bit code, x in the highest bit of each triple.
+static unsigned int mortonCode(unsigned int, const point3& p) {
+	unsigned int x = (unsigned int)std::min(std::max(p.x * 1024.f, 0.f), 1023.f);
+	unsigned int y = (unsigned int)std::min(std::max(p.y * 1024.f, 0.f), 1023.f);
+	unsigned int z = (unsigned int)std::min(std::max(p.z * 1024.f, 0.f), 1023.f);
+	return (expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+}
+
+unsigned int mortonCode30(const point3& p) {
+	return mortonCode(0u, p);
+}
+
+// 63 bit code for scenes with more primitives than a 30 bit code can separate.
+static unsigned long long mortonCode(unsigned long long, const point3& p) {
+	const float scale = float(1 << 21);
+	unsigned long long x = (unsigned long long)std::min(std::max(p.x * scale, 0.f), scale - 1.f);
+	unsigned long long y = (unsigned long long)std::min(std::max(p.y * scale, 0.f), scale - 1.f);
+	unsigned long long z = (unsigned long long)std::min(std::max(p.z * scale, 0.f), scale - 1.f);
+	return (expandBits21(x) << 2) | (expandBits21(y) << 1) | expandBits21(z);
+}
+
+static inline int countLeadingZeros(unsigned long long v) {
+#ifdef _MSC_VER
+	unsigned long index;
+	return _BitScanReverse64(&index, v) ? 63 - int(index) : 64;
+#else
+	return v ? __builtin_clzll(v) : 64;
+#endif
+}
+
+/****************************************************************************/
+
+// Internal node of the radix tree. Children at or above numPrims - 1 are
+// leaves, child - (numPrims - 1) being the sorted primitive.
+class RadixNode {
+public:
+	int first; // Range of sorted primitives below this node
+	int last;
+	int children[2];
+	int parent = -1;
+	AABB bounds;
+};
+
+template <typename Key>
+class RadixTree {
+public:
+	const std::vector<Key>& keys;
+	int n;
+
+	RadixTree(const std::vector<Key>& k) : keys(k), n(k.size()) {}
+
+	// Length of the common prefix of keys i and j, with equal keys told apart
+	// by their position so that every split is well defined.
+	int delta(int i, int j) const {
+		if (j < 0 || j >= n) { return -1; }
+		if (keys[i] == keys[j]) {
+			return int(sizeof(Key) * 8) + countLeadingZeros((unsigned long long)(i ^ j)) - 32;
+		}
+		return countLeadingZeros((unsigned long long)(keys[i] ^ keys[j])) - (64 - int(sizeof(Key) * 8));
+	}
+
+	void emit(int i, RadixNode& node) const {
+		int d = (delta(i, i + 1) - delta(i, i - 1)) > 0 ? 1 : -1;
+
+		// Upper bound on the length of the range, then binary search for its end.
+		int deltaMin = delta(i, i - d);
+		int lmax = 2;
+		while (delta(i, i + lmax * d) > deltaMin) {
+			lmax *= 2;
+		}
+		int l = 0;
+		for (int t = lmax / 2; t >= 1; t /= 2) {
+			if (delta(i, i + (l + t) * d) > deltaMin) {
+				l += t;
+			}
+		}
+		int j = i + l * d;
+
+		// Binary search for the split inside the range.
+		int deltaNode = delta(i, j);
+		int s = 0;
+		for (int div = 2; ; div *= 2) {
+			int t = (l + div - 1) / div;
+			if (delta(i, i + (s + t) * d) > deltaNode) {
+				s += t;
+			}
+			if (t <= 1) { break; }
+		}
+		int split = i + s * d + std::min(d, 0);
+
+		node.first = std::min(i, j);
+		node.last = std::max(i, j);
+		node.children[0] = (node.first == split) ? (n - 1) + split : split;
+		node.children[1] = (node.last == split + 1) ? (n - 1) + split + 1 : split + 1;
+	}
+};
+
+// Highest differing Morton bit between the ends of the range, as an axis.
+template <typename Key>
+static int splitAxis(const std::vector<Key>& keys, const RadixNode& node) {
+	unsigned long long diff = (unsigned long long)(keys[node.first] ^ keys[node.last]);
+	if (diff == 0) { return 0; }
+	int bit = 63 - countLeadingZeros(diff);
+	return 2 - (bit % 3);
+}
+
+template <typename Key>
+static int flattenRadix(BVH& bvh, const std::vector<RadixNode>& radix, const std::vector<Key>& keys, int node) {
+	int n = radix.size() + 1;
+	int index = bvh.nodes.size();
+	bvh.nodes.push_back(LinearBVHNode());
+
+	LinearBVHNode linear;
+	linear.pad = 0;
+
+	if (node >= n - 1) { // Single primitive
+		const AABB& b = bvh.prims[node - (n - 1)].bounds;
+		linear.min = b.min;
+		linear.max = b.max;
+		linear.offset = node - (n - 1);
+		linear.numPrims = 1;
+		linear.axis = 0;
+	}
+	else {
+		const RadixNode& r = radix[node];
+		linear.min = r.bounds.min;
+		linear.max = r.bounds.max;
+		linear.axis = (unsigned char)splitAxis(keys, r);
+
+		if (r.last - r.first + 1 <= MAX_LEAF_PRIMS) {
+			linear.offset = r.first;
+			linear.numPrims = (unsigned short)(r.last - r.first + 1);
+		}
+		else {
+			flattenRadix(bvh, radix, keys, r.children[0]);
+			linear.offset = flattenRadix(bvh, radix, keys, r.children[1]);
+			linear.numPrims = 0;
+		}
+	}
+	bvh.nodes[index] = linear;
+	return index;
+}
+
+template <typename Key>
+static void buildRadixTree(BVH& bvh) {
+	int n = bvh.prims.size();
+
+	AABB centroidBounds;
+	for (int i = 0; i < n; i++) {
+		centroidBounds.grow(bvh.prims[i].centroid);
+	}
+	point3 extent = glm::max(centroidBounds.max - centroidBounds.min, point3(FLT_MIN, FLT_MIN, FLT_MIN));
+
+	std::vector<Key> keys(n);
+	std::vector<int> index(n);
+	parallelFor(0, n, [&](int i) {
+		keys[i] = mortonCode(Key(), (bvh.prims[i].centroid - centroidBounds.min) / extent);
+		index[i] = i;
+	});
+
+	radixSort(keys, index);
+
+	std::vector<Primitive> sorted(n);
+	parallelFor(0, n, [&](int i) {
+		sorted[i] = bvh.prims[index[i]];
+	});
+	bvh.prims.swap(sorted);
+
+	if (n == 1) {
+		LinearBVHNode leaf;
+		leaf.min = bvh.prims[0].bounds.min;
+		leaf.max = bvh.prims[0].bounds.max;
+		leaf.offset = 0;
+		leaf.numPrims = 1;
+		leaf.axis = 0;
+		leaf.pad = 0;
+		bvh.nodes.push_back(leaf);
+		return;
+	}
+
+	// Every internal node only depends on the keys, so they are all emitted at once.
+	RadixTree<Key> tree(keys);
+	std::vector<RadixNode> radix(n - 1);
+	std::vector<int> leafParent(n);
+	parallelFor(0, n - 1, [&](int i) {
+		tree.emit(i, radix[i]);
+	});
+	for (int i = 0; i < n - 1; i++) {
+		for (int c = 0; c < 2; c++) {
+			int child = radix[i].children[c];
+			if (child >= n - 1) {
+				leafParent[child - (n - 1)] = i;
+			}
+			else {
+				radix[child].parent = i;
+			}
+		}
+	}
+
+	// Bounds bottom-up: each leaf walks towards the root, and the second
+	// thread to arrive at a node is the one that merges its children.
+	std::vector<std::atomic<int> > arrivals(n - 1);
+	for (int i = 0; i < n - 1; i++) {
+		arrivals[i] = 0;
+	}
+	parallelFor(0, n, [&](int leaf) {
+		int node = leafParent[leaf];
+		while (node >= 0) {
+			if (arrivals[node].fetch_add(1) == 0) { break; } // Sibling not done yet
+
+			RadixNode& r = radix[node];
+			r.bounds = AABB();
+			for (int c = 0; c < 2; c++) {
+				int child = r.children[c];
+				r.bounds.grow((child >= n - 1) ? bvh.prims[child - (n - 1)].bounds : radix[child].bounds);
+			}
+			node = r.parent;
+		}
+	});
+
+	bvh.nodes.reserve(2 * n);
+	flattenRadix(bvh, radix, keys, 0);
+}
+
+void BVH::buildLinear(const std::vector<Object *>& objs) {
+	clear();
+	gatherPrimitives(objs);
+
+	if (prims.empty()) {
+		prepareRefit(objs.size());
+		return;
+	}
+
+	if (prims.size() > LONG_KEYS_ABOVE) {
+		buildRadixTree<unsigned long long>(*this);
+	}
+	else {
+		buildRadixTree<unsigned int>(*this);
+	}
+	pack(objs);
+	prepareRefit(objs.size());
+}
@@ -0,0 +1,280 @@
+#include "net.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+typedef int socklen_t;
+#define CLOSE_SOCKET closesocket
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define CLOSE_SOCKET ::close
+#endif
+
+#ifdef MSG_NOSIGNAL // A worker that has gone away must not kill the sender with SIGPIPE
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+const unsigned int MAX_MESSAGE_BYTES = 1u << 30;
+
+
+#ifdef _WIN32
+class WinsockInit {
+public:
+	WinsockInit() {
+		WSADATA data;
+		WSAStartup(MAKEWORD(2, 2), &data);
+	}
+	~WinsockInit() { WSACleanup(); }
+};
+static WinsockInit winsockInit;
+#endif
+
+static long long fromSocket(SOCKET s) {
+	return (s == INVALID_SOCKET) ? -1 : (long long)s;
+}
+
+static void configure(SOCKET s) {
+	int on = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on)); // Tile requests are tiny and latency bound
+#ifdef SO_NOSIGPIPE
+	setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&on, sizeof(on));
+#endif
+}
+
+static void putU32(unsigned char* p, unsigned int v) {
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+static unsigned int getU32(const unsigned char* p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+/****************************************************************************/
+
+void Connection::close() {
+	if (open()) { CLOSE_SOCKET(SOCKET(handle)); }
+	handle = -1;
+}
+
+static bool sendAll(SOCKET s, const unsigned char* data, size_t size) {
+	while (size > 0) {
+		int chunk = int(std::min<size_t>(size, 1 << 20));
+		int sent = ::send(s, (const char*)data, chunk, SEND_FLAGS);
+		if (sent <= 0) { return false; } // Closed, failed or timed out
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool receiveAll(SOCKET s, unsigned char* data, size_t size) {
+	while (size > 0) {
+		int chunk = int(std::min<size_t>(size, 1 << 20));
+		int got = ::recv(s, (char*)data, chunk, 0);
+		if (got <= 0) { return false; } // Closed, failed or timed out
+		data += got;
+		size -= got;
+	}
+	return true;
+}
+
+bool Connection::send(int type, const std::vector<unsigned char>& payload) {
+	if (!open()) { return false; }
+	unsigned char header[8];
+	putU32(header, unsigned(type));
+	putU32(header + 4, unsigned(payload.size()));
+
+	return sendAll(SOCKET(handle), header, sizeof(header)) &&
+		(payload.empty() || sendAll(SOCKET(handle), &payload[0], payload.size()));
+}
+
+bool Connection::receive(int& type, std::vector<unsigned char>& payload) {
+	if (!open()) { return false; }
+	unsigned char header[8];
+	bool ok = receiveAll(SOCKET(handle), header, sizeof(header));
+
+	unsigned int size = ok ? getU32(header + 4) : 0;
+	ok = ok && size <= MAX_MESSAGE_BYTES;
+	if (ok) {
+		type = int(getU32(header));
+		payload.resize(size);
+		ok = (size == 0) || receiveAll(SOCKET(handle), &payload[0], size);
+	}
+	if (!ok) { close(); }
+	return ok;
+}
+
+void Connection::shutdownSend() {
+#ifdef _WIN32
+	if (open()) { shutdown(SOCKET(handle), SD_SEND); }
+#else
+	if (open()) { shutdown(SOCKET(handle), SHUT_WR); }
+#endif
+}
+
+void Connection::setTimeout(int ms) {
+	if (!open()) { return; }
+#ifdef _WIN32
+	DWORD timeout = ms;
+#else
+	timeval timeout;
+	timeout.tv_sec = ms / 1000;
+	timeout.tv_usec = (ms % 1000) * 1000;
+#endif
+	setsockopt(SOCKET(handle), SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(SOCKET(handle), SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+bool Listener::listen(int port) {
+	SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET) { return false; }
+
+	int on = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on)); // Rerun straight away on the same port
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons((unsigned short)port);
+
+	if (bind(s, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(s, 64) != 0) {
+		CLOSE_SOCKET(s);
+		return false;
+	}
+	handle = fromSocket(s);
+	return true;
+}
+
+Connection Listener::accept() {
+	if (handle < 0) { return Connection(); }
+	SOCKET s = ::accept(SOCKET(handle), NULL, NULL);
+	if (s != INVALID_SOCKET) { configure(s); }
+	return Connection(fromSocket(s));
+}
+
+void Listener::close() {
+	if (handle >= 0) { CLOSE_SOCKET(SOCKET(handle)); }
+	handle = -1;
+}
+
+Connection connectTo(const std::string& host, int port) {
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo* found = NULL;
+	std::string service = std::to_string(port);
+	if (getaddrinfo(host.c_str(), service.c_str(), &hints, &found) != 0) { return Connection(); }
+
+	SOCKET s = INVALID_SOCKET;
+	for (addrinfo* a = found; a != NULL && s == INVALID_SOCKET; a = a->ai_next) {
+		s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (s != INVALID_SOCKET && connect(s, a->ai_addr, (socklen_t)a->ai_addrlen) != 0) {
+			CLOSE_SOCKET(s);
+			s = INVALID_SOCKET;
+		}
+	}
+	freeaddrinfo(found);
+
+	if (s != INVALID_SOCKET) { configure(s); }
+	return Connection(fromSocket(s));
+}
+
+void waitReadable(const std::vector<long long>& handles, int timeoutMs, std::vector<bool>& readable) {
+	fd_set set;
+	FD_ZERO(&set);
+	long long highest = -1;
+	for (int i = 0; i < handles.size(); i++) {
+		if (handles[i] < 0) { continue; }
+		FD_SET(SOCKET(handles[i]), &set);
+		highest = std::max(highest, handles[i]);
+	}
+
+	timeval timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_usec = (timeoutMs % 1000) * 1000;
+	int ready = select(int(highest + 1), &set, NULL, NULL, &timeout); // The first argument is ignored on Windows
+
+	readable.assign(handles.size(), false);
+	for (int i = 0; i < handles.size() && ready > 0; i++) {
+		readable[i] = handles[i] >= 0 && FD_ISSET(SOCKET(handles[i]), &set);
+	}
+}
+
+/****************************************************************************/
+
+void MessageWriter::putInt(int value) {
+	size_t at = bytes.size();
+	bytes.resize(at + 4);
+	putU32(&bytes[at], unsigned(value));
+}
+
+void MessageWriter::putLong(long long value) {
+	putInt(int(value & 0xFFFFFFFF));
+	putInt(int(value >> 32));
+}
+
+void MessageWriter::putFloat(float value) {
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	putInt(int(bits));
+}
+
+void MessageWriter::putString(const std::string& value) {
+	putInt(int(value.size()));
+	bytes.insert(bytes.end(), value.begin(), value.end());
+}
+
+int MessageReader::getInt() {
+	if (at + 4 > bytes.size()) {
+		ok = false;
+		return 0;
+	}
+	at += 4;
+	return int(getU32(&bytes[at - 4]));
+}
+
+long long MessageReader::getLong() {
+	unsigned int low = unsigned(getInt());
+	long long high = getInt();
+	return (long long)((unsigned long long)high << 32 | low);
+}
+
+float MessageReader::getFloat() {
+	unsigned int bits = unsigned(getInt());
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+std::string MessageReader::getString() {
+	int size = getInt();
+	if (size < 0 || at + size > bytes.size()) {
+		ok = false;
+		return std::string();
+	}
+	at += size;
+	return std::string(bytes.begin() + (at - size), bytes.begin() + at);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+
+// Blocking TCP connections for the distributed renderer, over BSD sockets or
+// Winsock. Messages are a type and a length, then the payload, all sizes and
+// numbers little endian so that workers on other machines read them the same.
+class Connection {
+public:
+	long long handle; // Socket, or -1 when closed
+
+	Connection() : handle(-1) {}
+	explicit Connection(long long handle) : handle(handle) {}
+
+	bool open() const { return handle >= 0; }
+	void close();
+
+	// Leaves the connection open when it fails, so that whatever the other
+	// side sent before it went away can still be received.
+	bool send(int type, const std::vector<unsigned char>& payload);
+	bool receive(int& type, std::vector<unsigned char>& payload); // Waits for a whole message, closes on failure
+	void shutdownSend(); // The other side's receive() fails once it has read everything sent so far
+	void setTimeout(int ms); // send() and receive() fail rather than wait longer for the other side
+};
+
+class Listener {
+public:
+	long long handle;
+
+	Listener() : handle(-1) {}
+
+	bool listen(int port); // On every interface
+	Connection accept();
+	void close();
+};
+
+Connection connectTo(const std::string& host, int port);
+
+// Wait up to timeoutMs for any of handles to have data or a connection to
+// accept. readable[i] says whether handles[i] does.
+void waitReadable(const std::vector<long long>& handles, int timeoutMs, std::vector<bool>& readable);
+
+// Payloads are built and read with these.
+class MessageWriter {
+public:
+	std::vector<unsigned char> bytes;
+
+	void putInt(int value);
+	void putLong(long long value);
+	void putFloat(float value);
+	void putString(const std::string& value);
+};
+
+// Reads past the end give zeros and clear ok, so a message can be read in
+// full and checked once.
+class MessageReader {
+public:
+	const std::vector<unsigned char>& bytes;
+	size_t at;
+	bool ok;
+
+	MessageReader(const std::vector<unsigned char>& bytes) : bytes(bytes), at(0), ok(true) {}
+
+	int getInt();
+	long long getLong();
+	float getFloat();
+	std::string getString();
+};
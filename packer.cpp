@@ -4,6 +4,7 @@
 const colour3 ZEROS = colour3(0, 0, 0);
 
 extern std::vector<Object *> objects;
+extern std::vector<Material> materialTable;
 extern std::vector<Light *> lights;
 
 extern int objectIds[6];
@@ -25,32 +26,45 @@ void packObjects(int &geoId, int &matId) {
 		objectIds[i] = geoId;
 		int index = geoId;
 
-		geometry[index++] = point3(object->type, 0, object->radius);
+		float r2 = (object->type == SPHERE) ? object->radius * object->radius : 0.f;
+		geometry[index++] = point3(object->type, r2, object->radius);
 		geometry[index++] = point3(matId, 0, 0);
 		geometry[index++] = object->pos;
 		geometry[index++] = object->normal;
 
+		// The shader has no instancing, so shared meshes are placed here.
+		// Triangles are the vertex and edges of TriangleArrays, then the normal.
 		int j = 0;
-		for (; j < object->tris.size(); j++) {
-			Triangle* triangle = object->tris[j];
-
-			geometry[index++] = triangle->vertices[0];
-			geometry[index++] = triangle->vertices[1];
-			geometry[index++] = triangle->vertices[2];
-			geometry[index++] = triangle->normal;
+		for (; object->mesh != NULL && j < object->mesh->size(); j++) {
+			point3 A, E1, E2;
+			object->mesh->triangle(j, A, E1, E2);
+
+			if (object->instanced) {
+				A = point3(object->transform * glm::vec4(A, 1));
+				E1 = point3(object->transform * glm::vec4(E1, 0));
+				E2 = point3(object->transform * glm::vec4(E2, 0));
+			}
+
+			geometry[index++] = A;
+			geometry[index++] = E1;
+			geometry[index++] = E2;
+			geometry[index++] = glm::cross(E1, E2);
+		}
+		if (object->type == MESH) {
+			geometry[geoId].g = j; // Update number of triangles
 		}
-		geometry[geoId].g = j; // Update number of triangles
 		geoId = index; // Set geoId to after the end of this entry
 
 		// Material
+		const Material& material = materialTable[object->material];
 		index = matId;
 
-		materials[index++] = object->ambient;
-		materials[index++] = object->diffuse;
-		materials[index++] = object->specular;
-		materials[index++] = object->reflective;
-		materials[index++] = object->transmissive;
-		materials[index++] = point3(object->shininess, object->refraction, 0);
+		materials[index++] = material.ambient;
+		materials[index++] = material.diffuse;
+		materials[index++] = material.specular;
+		materials[index++] = material.reflective;
+		materials[index++] = material.transmissive;
+		materials[index++] = point3(material.shininess, material.refraction, 0);
 
 		matId = index; // Set matId to after the end of this entry
 	}
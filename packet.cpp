@@ -0,0 +1,125 @@
+// Packet traversal of the binary BVH for coherent primary rays, after
+// Overbeck, Ramamoorthi and Mark, "Large Ray Packets for Real-Time Whitted
+// Ray Tracing" (2008). The packet carries the index of its first ray still
+// inside the current subtree. A node is entered as soon as that ray hits it;
+// otherwise an interval arithmetic test bounds all rays at once, and only
+// when that can't reject the node are the rest searched for a new first ray.
+// Each node is fetched once per packet instead of once per ray.
+
+#include "bvh.h"
+
+#include <cmath>
+
+
+// Interval bounds on the packet's inverse directions. An axis on which the
+// rays don't all point the same way gives no bound.
+class PacketFrustum {
+public:
+	bool bounded[3];
+	bool dirIsNeg[3];
+	float invLo[3];
+	float invHi[3];
+
+	PacketFrustum(const Ray* rays, int count) {
+		for (int a = 0; a < 3; a++) {
+			invLo[a] = invHi[a] = rays[0].invD[a];
+			bounded[a] = std::isfinite(rays[0].invD[a]);
+			dirIsNeg[a] = rays[0].sign[a];
+
+			for (int i = 1; i < count && bounded[a]; i++) {
+				float inv = rays[i].invD[a];
+				bounded[a] = std::isfinite(inv) && rays[i].sign[a] == dirIsNeg[a];
+				invLo[a] = std::min(invLo[a], inv);
+				invHi[a] = std::max(invHi[a], inv);
+			}
+		}
+	}
+
+	// True when no ray of the packet can pass intersectBounds(node, rays[i], maxDist).
+	// Rounding is monotonic, so the products at the ends of the interval bound
+	// what every ray computes, and the far side gets the same slack.
+	bool misses(const LinearBVHNode& node, const point3& e, float maxDist) const {
+		float tmin = 0.f;
+		float tmax = maxDist;
+
+		for (int a = 0; a < 3; a++) {
+			if (!bounded[a]) { continue; }
+			float nearSide = (dirIsNeg[a] ? node.max[a] : node.min[a]) - e[a];
+			float farSide = (dirIsNeg[a] ? node.min[a] : node.max[a]) - e[a];
+
+			float t0 = std::min(nearSide * invLo[a], nearSide * invHi[a]);
+			float t1 = std::max(farSide * invLo[a], farSide * invHi[a]) * 1.00000024f;
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+		return tmin > tmax;
+	}
+};
+
+// Leaves test every remaining ray that hits their box, one at a time, so the
+// hits are the ones intersect() finds apart from the order ties are met in.
+void BVH::intersectPacket(RayPacket& packet) const {
+	if (nodes.empty() || packet.count <= 0) { return; }
+
+	const point3& e = packet.e;
+	const Ray* rays = packet.rays;
+	int count = packet.count;
+	float farthest = 0.f; // Largest dist of any ray, for the frustum test
+
+	for (int i = 0; i < count; i++) {
+		packet.dist[i] = std::min(packet.dist[i], rays[i].tmax);
+		farthest = std::max(farthest, packet.dist[i]);
+	}
+	PacketFrustum frustum(rays, count);
+
+	int stack[BVH_STACK_SIZE];
+	int firstStack[BVH_STACK_SIZE];
+	int top = 0;
+	int current = 0;
+	int first = 0;
+	COUNT_STAT(rays, count);
+
+	while (true) {
+		const LinearBVHNode& node = nodes[current];
+		COUNT_STAT(nodes, 1);
+
+		bool visit = intersectBounds(node, rays[first], packet.dist[first]);
+		if (!visit && !frustum.misses(node, e, farthest)) {
+			for (int i = first + 1; i < count && !visit; i++) {
+				if (intersectBounds(node, rays[i], packet.dist[i])) {
+					first = i;
+					visit = true;
+				}
+			}
+		}
+
+		if (visit) {
+			if (node.numPrims > 0) {
+				for (int i = first; i < count; i++) {
+					if (i == first || intersectBounds(node, rays[i], packet.dist[i])) {
+						intersectLeaf(node.offset, node.numPrims, rays[i], packet.dist[i], packet.object[i], packet.triangle[i]);
+					}
+				}
+
+				farthest = 0.f;
+				for (int i = 0; i < count; i++) {
+					farthest = std::max(farthest, packet.dist[i]);
+				}
+			}
+			else {
+				// Near child first, going by the first ray's direction.
+				int nearChild = current + 1;
+				int farChild = node.offset;
+				if (rays[first].sign[node.axis]) { std::swap(nearChild, farChild); }
+
+				stack[top] = farChild;
+				firstStack[top++] = first;
+				current = nearChild;
+				continue;
+			}
+		}
+		if (top == 0) { break; }
+		current = stack[--top];
+		first = firstStack[top];
+	}
+}
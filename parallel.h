@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+inline int numThreads() {
+	unsigned int n = std::thread::hardware_concurrency();
+	return (n > 0) ? int(n) : 1;
+}
+
+// Split [begin, end) into one contiguous chunk per thread and call
+// fn(first, last, chunk) for each. Chunk boundaries only depend on the range
+// and the thread count, so two calls over the same range line up.
+template <typename F>
+void parallelChunks(int begin, int end, F fn, int threads = numThreads()) {
+	long long n = end - begin;
+	if (threads <= 1 || n < 2 * threads) {
+		fn(begin, end, 0);
+		for (int t = 1; t < threads; t++) {
+			fn(end, end, t); // Keep every chunk index visited
+		}
+		return;
+	}
+
+	std::vector<std::thread> workers;
+	for (int t = 1; t < threads; t++) {
+		int first = begin + int(n * t / threads);
+		int last = begin + int(n * (t + 1) / threads);
+		workers.push_back(std::thread(fn, first, last, t));
+	}
+	fn(begin, begin + int(n / threads), 0);
+
+	for (int t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+}
+
+template <typename F>
+void parallelFor(int begin, int end, F fn) {
+	parallelChunks(begin, end, [&fn](int first, int last, int) {
+		for (int i = first; i < last; i++) {
+			fn(i);
+		}
+	});
+}
+
+// Least significant digit radix sort of (key, index) pairs, 8 bits a pass.
+// Each thread histograms its own chunk, a prefix sum over (digit, thread)
+// gives every thread its own output slots, and the scatter runs in parallel.
+template <typename Key>
+void radixSort(std::vector<Key>& keys, std::vector<int>& index, int threads = numThreads()) {
+	const int RADIX = 256;
+	int n = keys.size();
+	threads = std::max(threads, 1);
+	std::vector<Key> keysOut(n);
+	std::vector<int> indexOut(n);
+	std::vector<int> offsets(threads * RADIX);
+
+	for (int shift = 0; shift < int(sizeof(Key) * 8); shift += 8) {
+		std::fill(offsets.begin(), offsets.end(), 0);
+
+		parallelChunks(0, n, [&](int first, int last, int t) {
+			int* histogram = &offsets[t * RADIX];
+			for (int i = first; i < last; i++) {
+				histogram[(keys[i] >> shift) & (RADIX - 1)]++;
+			}
+		}, threads);
+
+		int sum = 0;
+		for (int digit = 0; digit < RADIX; digit++) {
+			for (int t = 0; t < threads; t++) {
+				int count = offsets[t * RADIX + digit];
+				offsets[t * RADIX + digit] = sum;
+				sum += count;
+			}
+		}
+
+		parallelChunks(0, n, [&](int first, int last, int t) {
+			int* next = &offsets[t * RADIX];
+			for (int i = first; i < last; i++) {
+				int slot = next[(keys[i] >> shift) & (RADIX - 1)]++;
+				keysOut[slot] = keys[i];
+				indexOut[slot] = index[i];
+			}
+		}, threads);
+
+		keys.swap(keysOut);
+		index.swap(indexOut);
+	}
+}
+
+/****************************************************************************/
+
+// Fixed size work-stealing deque of task indices (Chase and Lev, "Dynamic
+// Circular Work-Stealing Deque", 2005, with the memory orders of Le et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models", 2013). The
+// owner pushes and takes at the bottom, other threads steal from the top,
+// and only the last task left needs a compare and swap.
+class TaskDeque {
+public:
+	static const int EMPTY = -1;
+	static const int ABORT = -2; // Lost a race, worth trying again
+
+	TaskDeque(int capacity) : tasks(new std::atomic<int>[capacity]), capacity(capacity) {
+		top.store(0);
+		bottom.store(0);
+	}
+
+	// Owner only, and no more than capacity tasks in all.
+	void push(int task) {
+		int b = bottom.load(std::memory_order_relaxed);
+		tasks[b % capacity].store(task, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	// Owner only. The most recently pushed task, or EMPTY.
+	int take() {
+		int b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int t = top.load(std::memory_order_relaxed);
+
+		if (t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return EMPTY;
+		}
+		int task = tasks[b % capacity].load(std::memory_order_relaxed);
+		if (t == b) {
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				task = EMPTY; // A thief got it
+			}
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return task;
+	}
+
+	// Any thread. The oldest task, EMPTY or ABORT.
+	int steal() {
+		int t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b) { return EMPTY; }
+		int task = tasks[t % capacity].load(std::memory_order_relaxed);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			return ABORT;
+		}
+		return task;
+	}
+
+private:
+	std::atomic<int> top;
+	char padding[60]; // Thieves write top, the owner bottom
+	std::atomic<int> bottom;
+	std::unique_ptr<std::atomic<int>[]> tasks;
+	int capacity;
+};
+
+// What one thread of parallelTasks() did. busy is the time spent in tasks,
+// idle the rest of the run: looking for work and waiting for the others.
+class WorkerStats {
+public:
+	double busy = 0.0; // Seconds
+	double idle = 0.0;
+	int tasks = 0;
+	int stolen = 0; // Of tasks, the ones taken from another thread
+};
+
+// Call fn(task) for task in [0, count) on threads threads. Each thread starts
+// on its own contiguous run of the range, in order, so tasks should be
+// numbered so that neighbours share data. A thread that runs out steals
+// from the far end of a random other thread's run, which is the work that
+// thread would have reached last. stats gets one entry per thread.
+template <typename F>
+void parallelTasks(int count, F fn, std::vector<WorkerStats>& stats, int threads = numThreads()) {
+	typedef std::chrono::steady_clock Clock;
+	threads = std::max(threads, 1);
+	stats.assign(threads, WorkerStats());
+
+	std::vector<std::unique_ptr<TaskDeque> > deques;
+	for (int t = 0; t < threads; t++) {
+		int first = int((long long)count * t / threads);
+		int last = int((long long)count * (t + 1) / threads);
+		deques.push_back(std::unique_ptr<TaskDeque>(new TaskDeque(std::max(last - first, 1))));
+		for (int task = last - 1; task >= first; task--) {
+			deques[t]->push(task); // Taken from the bottom, so first comes out first
+		}
+	}
+
+	Clock::time_point start = Clock::now();
+	auto work = [&](int self) {
+		WorkerStats& mine = stats[self];
+		unsigned int random = 2654435761u * (self + 1);
+
+		while (true) {
+			int task = deques[self]->take();
+			bool stolen = false;
+
+			// Every other deque is tried until one gives up a task. Tasks are
+			// never added once the run starts, so a pass that finds nothing
+			// but empty deques means the work is done.
+			while (task == TaskDeque::EMPTY && threads > 1) {
+				bool retry = false;
+				int offset = 1 + int(random % unsigned(threads - 1));
+				random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+
+				for (int k = 0; k < threads && task == TaskDeque::EMPTY; k++) {
+					int victim = (self + offset + k) % threads;
+					if (victim == self) { continue; }
+					int result = deques[victim]->steal();
+					if (result == TaskDeque::ABORT) {
+						retry = true;
+					}
+					else if (result != TaskDeque::EMPTY) {
+						task = result;
+						stolen = true;
+					}
+				}
+				if (!retry) { break; }
+			}
+			if (task == TaskDeque::EMPTY) { break; }
+
+			Clock::time_point begin = Clock::now();
+			fn(task);
+			mine.busy += std::chrono::duration<double>(Clock::now() - begin).count();
+			mine.tasks++;
+			mine.stolen += stolen ? 1 : 0;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (int t = 1; t < threads; t++) {
+		workers.push_back(std::thread(work, t));
+	}
+	work(0);
+
+	for (int t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+	// Idle also covers the wait for the slowest thread, up to the end of the run.
+	double wall = std::chrono::duration<double>(Clock::now() - start).count();
+	for (int t = 0; t < threads; t++) {
+		stats[t].idle = wall - stats[t].busy;
+	}
+}
@@ -191,6 +191,7 @@ void bounceTransform() {
 	//rot = glm::rotate(rot, glm::radians(eyeTheta.z), glm::vec3(0, 0, 1));
 	model_view = trans * rot;
 	glUniformMatrix4fv(BounceTrans, 1, GL_FALSE, glm::value_ptr(model_view));
+	animateObject(bouncingObject, model_view); // Keep the CPU scene in step
 
 }
 
@@ -207,6 +208,7 @@ void spinTransform() {
 	trans = glm::rotate(trans, glm::radians(spinTheta.z), glm::vec3(0, 0, 1));
 	trans = glm::translate(trans, -model_pos);
 	glUniformMatrix4fv(SpinTrans, 1, GL_FALSE, glm::value_ptr(trans));
+	animateObject(spinningObject, trans);
 }
 
 //----------------------------------------------------------------------------
@@ -313,12 +315,14 @@ void keyboard( unsigned char key, int x, int y ) {
 		printf("\n  RAY_LIMIT: %d \n", RAY_LIMIT);
 		break;
 	case ',':
+		animateObject(bouncingObject, glm::mat4()); // Put the last one back
 		bouncingObject++;
 		bouncePos.y = 0;
 		bounceVelo.y = 0;
 		printf("\n  bouncingObject: %d \n", bouncingObject);
 		break;
 	case '.':
+		animateObject(spinningObject, glm::mat4());
 		spinningObject++;
 		spinTheta.y = 0;
 		printf("\n  spinningObject: %d \n", spinningObject);
@@ -0,0 +1,193 @@
+#include "quantized.h"
+#include "bvh.h"
+#include "parallel.h"
+
+#include <cmath>
+#include <unordered_map>
+
+const float QUANTIZED_STEPS = 65535.f;
+const float OCTAHEDRAL_STEPS = 32767.f;
+
+
+/****************************************************************************/
+
+static float signNotZero(float x) {
+	return (x >= 0.f) ? 1.f : -1.f;
+}
+
+static unsigned int encodeSnorm16(float x) {
+	int q = int(std::floor(glm::clamp(x, -1.f, 1.f) * OCTAHEDRAL_STEPS + 0.5f));
+	return (unsigned int)(q & 0xFFFF);
+}
+
+static float decodeSnorm16(unsigned int bits) {
+	return float(short(bits & 0xFFFF)) / OCTAHEDRAL_STEPS;
+}
+
+// Project onto the octahedron |x| + |y| + |z| = 1, then fold the lower half
+// over the upper one so the whole sphere maps onto the square [-1, 1]^2.
+unsigned int encodeOctahedral(const point3& n) {
+	float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (!(l1 > 0.f)) { return encodeSnorm16(0.f) | encodeSnorm16(0.f) << 16; } // Degenerate, +z
+
+	float u = n.x / l1;
+	float v = n.y / l1;
+	if (n.z < 0.f) {
+		float foldedU = (1.f - std::abs(v)) * signNotZero(u);
+		float foldedV = (1.f - std::abs(u)) * signNotZero(v);
+		u = foldedU;
+		v = foldedV;
+	}
+	return encodeSnorm16(u) | encodeSnorm16(v) << 16;
+}
+
+point3 decodeOctahedral(unsigned int code) {
+	float u = decodeSnorm16(code);
+	float v = decodeSnorm16(code >> 16);
+	point3 n(u, v, 1.f - std::abs(u) - std::abs(v));
+	if (n.z < 0.f) {
+		n.x = (1.f - std::abs(v)) * signNotZero(u);
+		n.y = (1.f - std::abs(u)) * signNotZero(v);
+	}
+	return glm::normalize(n);
+}
+
+/****************************************************************************/
+
+// Vertices that land on the same quantized position are merged, which joins
+// the copies a triangle soup repeats for every triangle around a vertex.
+QuantizedMesh::QuantizedMesh(const TriangleArrays& tris) {
+	point3 lo(FLT_MAX, FLT_MAX, FLT_MAX);
+	point3 hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int j = 0; j < tris.size(); j++) {
+		for (int v = 0; v < 3; v++) {
+			lo = glm::min(lo, tris.vertex(j, v));
+			hi = glm::max(hi, tris.vertex(j, v));
+		}
+	}
+	if (tris.empty()) { lo = hi = point3(0.f); }
+
+	origin = lo;
+	step = (hi - lo) / QUANTIZED_STEPS;
+	point3 scale;
+	for (int a = 0; a < 3; a++) {
+		scale[a] = (step[a] > 0.f) ? 1.f / step[a] : 0.f;
+	}
+
+	std::unordered_map<unsigned long long, unsigned int> merged;
+	merged.reserve(tris.size());
+	indices.resize(3 * size_t(tris.size()));
+	normals.resize(tris.size());
+
+	for (int j = 0; j < tris.size(); j++) {
+		for (int v = 0; v < 3; v++) {
+			point3 q = (tris.vertex(j, v) - origin) * scale + 0.5f;
+			q = glm::min(glm::max(q, point3(0.f)), point3(QUANTIZED_STEPS));
+			unsigned long long key = (unsigned long long)q.x | (unsigned long long)q.y << 16 | (unsigned long long)q.z << 32;
+
+			auto found = merged.find(key);
+			if (found == merged.end()) {
+				found = merged.insert(std::make_pair(key, unsigned(positions.size() / 3))).first;
+				positions.push_back((unsigned short)q.x);
+				positions.push_back((unsigned short)q.y);
+				positions.push_back((unsigned short)q.z);
+			}
+			indices[3 * size_t(j) + v] = found->second;
+		}
+		normals[j] = encodeOctahedral(tris.normal(j));
+	}
+	positions.shrink_to_fit();
+}
+
+size_t QuantizedMesh::bytes() const {
+	return positions.size() * sizeof(positions[0]) + indices.size() * sizeof(indices[0]) + normals.size() * sizeof(normals[0]);
+}
+
+point3 QuantizedMesh::normal(int j) const {
+	return decodeOctahedral(normals[j]);
+}
+
+void QuantizedMesh::reorder(const std::vector<int>& order) {
+	std::vector<unsigned int> newIndices(3 * order.size());
+	std::vector<unsigned int> newNormals(order.size());
+
+	for (int k = 0; k < order.size(); k++) {
+		for (int v = 0; v < 3; v++) {
+			newIndices[3 * size_t(k) + v] = indices[3 * size_t(order[k]) + v];
+		}
+		newNormals[k] = normals[order[k]];
+	}
+	indices.swap(newIndices);
+	normals.swap(newNormals);
+}
+
+/****************************************************************************/
+
+// SAH build straight from the quantized triangles. There is no decoded copy
+// of the mesh and nothing is packed, so the peak is the mesh plus one
+// Primitive per triangle. The mesh is then put in leaf order, so leaf ranges
+// index its triangles directly, and the primitives are freed. Spatial splits
+// aren't used, as a triangle in several leaf slots would become several
+// triangles, and a shadow ray would only skip the one it left from.
+void BVH::buildQuantized(QuantizedMesh& mesh) {
+	clear();
+	prims.resize(mesh.size());
+	parallelFor(0, mesh.size(), [&](int j) {
+		Primitive& prim = prims[j];
+		prim.object = 0;
+		prim.triangle = j;
+		prim.bounds = AABB();
+		for (int v = 0; v < 3; v++) {
+			prim.bounds.grow(mesh.vertex(mesh.indices[3 * size_t(j) + v]));
+		}
+		prim.centroid = prim.bounds.centroid();
+	});
+
+	if (!prims.empty()) {
+		BVHNode* root = buildRecursive(0, prims.size(), 0);
+		flatten(root);
+		delete root;
+	}
+
+	std::vector<int> order(prims.size());
+	for (int k = 0; k < prims.size(); k++) {
+		order[k] = prims[k].triangle;
+	}
+	mesh.reorder(order);
+	quantized = &mesh;
+
+	std::vector<Primitive>().swap(prims);
+}
+
+bool BVH::intersectLeafQuantized(int first, int count, const Ray& ray,
+								 float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	bool hit = false;
+	COUNT_STAT(prims, count);
+
+	for (int j = first; j < first + count; j++) {
+		point3 v0, edge1, edge2;
+		quantized->triangle(j, v0, edge1, edge2);
+
+		float t = intersectTriangle(v0, edge1, edge2, ray);
+		if (t < dist) {
+			dist = t;
+			indexOfClosest = 0;
+			indexOfTriangle = j;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+bool BVH::occludedLeafQuantized(int first, int count, const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	COUNT_STAT(prims, count);
+
+	for (int j = first; j < first + count; j++) {
+		if (ignoreObject == 0 && j == ignoreTriangle) { continue; }
+
+		point3 v0, edge1, edge2;
+		quantized->triangle(j, v0, edge1, edge2);
+		if (intersectTriangle(v0, edge1, edge2, ray) < ray.tmax) { return true; }
+	}
+	return false;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "Object.h"
+
+#include <vector>
+
+
+// Compact storage for meshes too large to keep as TriangleArrays, such as
+// scans of millions of triangles. Vertices are shared between triangles
+// through an index buffer and stored as 16-bit fixed point within the mesh's
+// bounding box. Each triangle keeps the normal of the original triangle in
+// 32 bits, octahedrally encoded (Cigolle et al., "A Survey of Efficient
+// Representations for Independent Unit Vectors", JCGT 2014). A triangle
+// costs 16 bytes plus its share of the vertices, 6 bytes each, instead of 36.
+// Leaves decode their triangles as they test them, see BVH::buildQuantized().
+class QuantizedMesh {
+public:
+	point3 origin; // Low corner of the bounds
+	point3 step; // Size of one quantization step on each axis
+	std::vector<unsigned short> positions; // x, y, z of each vertex
+	std::vector<unsigned int> indices; // Three vertices per triangle
+	std::vector<unsigned int> normals; // One per triangle
+
+	QuantizedMesh(const TriangleArrays& tris);
+
+	int size() const { return int(indices.size() / 3); }
+	size_t bytes() const;
+
+	point3 vertex(unsigned int v) const {
+		const unsigned short* p = &positions[3 * v];
+		return origin + step * point3(float(p[0]), float(p[1]), float(p[2]));
+	}
+	// Vertex and edges as TriangleArrays holds them, for intersectTriangle().
+	void triangle(int j, point3& v0, point3& edge1, point3& edge2) const {
+		const unsigned int* index = &indices[3 * j];
+		v0 = vertex(index[0]);
+		edge1 = vertex(index[1]) - v0;
+		edge2 = vertex(index[2]) - v0;
+	}
+	point3 normal(int j) const; // Normalized
+
+	// Triangle k becomes the old triangle order[k].
+	void reorder(const std::vector<int>& order);
+};
+
+// Octahedral encoding of a unit vector, 16 bits per coordinate.
+unsigned int encodeOctahedral(const point3& n);
+point3 decodeOctahedral(unsigned int code);
@@ -2,10 +2,24 @@
 
 #include "raytracer.h"
 #include "Object.h"
+#include "intersect.h"
+#include "bvh.h"
+#include "wbvh.h"
+#include "grid.h"
+#include "bvhcache.h"
+#include "quantized.h"
+#include "simd.h"
+#include "parallel.h"
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
 #include <glm/glm.hpp>
 #include <glm/gtx/string_cast.hpp>
 
@@ -15,17 +29,81 @@ using json = nlohmann::json;
 
 const char* PATH = "scenes/";
 const float EPSILON = 0.0001f;
-const float ANTI_ACNE = 0.001f;
 const int RECURSION_LIMIT = 5;
+const int TRACE_STACK_SIZE = RECURSION_LIMIT + 2; // One pending sibling per level, plus the root
+const int GRID_MIN_SPHERES = 256; // Below this the widest BVH is as fast as the grid
 const colour3 ZEROS = colour3(0, 0, 0);
 
 double fov = 60;
 colour3 background_colour(0, 0, 0);
+int ACCELERATOR = ACCEL_AUTO;
+int BVH_BUILDER = BUILD_SAH;
+float SBVH_DUPLICATION = 0.3f;
+bool USE_BVH_CACHE = true;
+float WORTH_RECURSING = 0.005f;
+int QUANTIZE_MIN_TRIANGLES = 1 << 20;
 
 json scene;
 
+// An unbounded plane, copied out of its object so that the loop every ray
+// makes over the planes reads one small contiguous array.
+class Plane {
+public:
+	point3 pos;
+	point3 normal;
+	int object;
+};
+
 std::vector<Object *> objects;
+std::vector<Material> materialTable; // What objects[i]->material indexes
 std::vector<Light *> lights;
+std::vector<Mesh *> meshes; // Distinct triangle lists, shared by mesh objects
+std::vector<Plane> planes; // Unbounded objects, tested on every ray
+BVH bvh; // Everything else
+BVH4 bvh4; // Wide copies of bvh, only the selected one is built
+BVH8 bvh8;
+UniformGrid grid;
+int accelerator = ACCEL_BVH2; // Resolved ACCELERATOR
+
+// Rays cast, counted per thread and added to the shared total once per
+// trace(), tracePacket() or traceWavefront() call.
+std::atomic<long long> rayCount(0);
+thread_local long long pendingRays = 0;
+thread_local int lastTraceRays = 0; // Size of the ray tree of this thread's last trace()
+
+// Geometry of an animated object before any transform, saved on first use.
+class RestPose {
+public:
+	point3 pos;
+	glm::mat4 transform;
+	TriangleArrays tris;
+};
+std::map<int, RestPose> restPoses;
+
+// How a ray's colour combines into the ray that spawned it.
+enum { RAY_PRIMARY, RAY_REFLECTED, RAY_TRANSMITTED, RAY_INTERNAL, RAY_REFRACTED };
+
+// One ray of the tree a pixel spawns. Children are indices into the same
+// list, and colour holds the direct light at the hit until combineRay()
+// folds the children in. weight is how much of the ray's colour reaches
+// the pixel at most, the product of the reflective and transmissive
+// colours along the way.
+class TraceRay {
+public:
+	point3 e;
+	point3 s;
+	bool outside = true;
+	int level = 0;
+	int kind = RAY_PRIMARY;
+	int parent = -1;
+	int reflected = -1;
+	int transmitted = -1; // Transmitted, refracted or internally reflected
+	float dist = FLT_MAX;
+	int object = -1;
+	int triangle = -1;
+	colour3 weight = colour3(1, 1, 1);
+	colour3 colour = colour3(0, 0, 0);
+};
 
 
 /****************************************************************************/
@@ -79,8 +157,92 @@ int getIntType(std::string name) {
 
 /****************************************************************************/
 
+// Hash of the triangle arrays, to find repeated triangle lists.
+unsigned long long hashTriangles(const TriangleArrays& tris, unsigned long long hash = 14695981039346656037ull) {
+	for (int k = 0; k < 9; k++) {
+		const FloatArray& array = *tris.arrays(k);
+		hash = hashBytes(array.data(), array.size() * sizeof(float), hash);
+	}
+	return hash;
+}
+
+bool sameTriangles(const TriangleArrays& a, const TriangleArrays& b) {
+	for (int k = 0; k < 9; k++) {
+		if (*a.arrays(k) != *b.arrays(k)) { return false; }
+	}
+	return true;
+}
+
+// Parse a triangle list and return the Mesh holding it. A list that was seen
+// before gives back the existing Mesh, so repeated models are stored once.
+Mesh* parseMesh(json& triangles, std::multimap<unsigned long long, Mesh *>& byHash) {
+	Mesh* mesh = new Mesh();
+
+	for (json::iterator tryit = triangles.begin(); tryit != triangles.end(); ++tryit) {
+		json& triangle = *tryit;
+
+		point3 A = vector_to_vec3(triangle[0]);
+		point3 B = vector_to_vec3(triangle[1]);
+		point3 C = vector_to_vec3(triangle[2]);
+
+		mesh->tris.push_back(A, B, C);
+	} // for each triangle
+
+	unsigned long long hash = hashTriangles(mesh->tris);
+	auto range = byHash.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (sameTriangles(it->second->tris, mesh->tris)) {
+			delete mesh;
+			return it->second;
+		}
+	}
+
+	byHash.insert(std::make_pair(hash, mesh));
+	meshes.push_back(mesh);
+	return mesh;
+}
+
+// Row-major 4x4 matrix, as it reads in the scene file.
+glm::mat4 parseTransform(json& rows) {
+	glm::mat4 m(1.f);
+
+	for (int r = 0; r < 4; r++) {
+		for (int c = 0; c < 4; c++) {
+			m[c][r] = float(rows[r][c]);
+		}
+	}
+	return m;
+}
+
+// Index of material in materialTable, adding it unless an identical one is
+// already there.
+int addMaterial(const Material& material, std::multimap<unsigned long long, int>& byHash) {
+	unsigned long long hash = hashBytes(&material, sizeof(material));
+
+	auto range = byHash.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (memcmp(&materialTable[it->second], &material, sizeof(material)) == 0) {
+			return it->second;
+		}
+	}
+	materialTable.push_back(material);
+	byHash.insert(std::make_pair(hash, int(materialTable.size()) - 1));
+	return int(materialTable.size()) - 1;
+}
+
 void populateObjects() {
 	json& objectsJ = scene["objects"];
+	std::multimap<unsigned long long, Mesh *> byHash;
+	std::multimap<unsigned long long, int> materialsByHash;
+	std::map<std::string, Mesh *> named;
+
+	// Optional library of models that mesh objects refer to by name.
+	if (scene.find("meshes") != scene.end()) {
+		json& meshesJ = scene["meshes"];
+		for (json::iterator it = meshesJ.begin(); it != meshesJ.end(); ++it) {
+			named[it.key()] = parseMesh(it.value(), byHash);
+		}
+	}
 
 	for (json::iterator it = objectsJ.begin(); it != objectsJ.end(); ++it) {
 
@@ -98,46 +260,74 @@ void populateObjects() {
 			obj->radius = float(object["radius"]);
 		}
 		if (object.find("triangles") != object.end()) {
-
-			for (json::iterator tryit = object["triangles"].begin(); tryit != object["triangles"].end(); ++tryit) {
-				json& triangle = *tryit;
-
-				point3 A = vector_to_vec3(triangle[0]);
-				point3 B = vector_to_vec3(triangle[1]);
-				point3 C = vector_to_vec3(triangle[2]);
-				point3 N = glm::cross(B - A, C - A);
-
-				Triangle* tri = new Triangle(A, B, C, N);
-
-				obj->tris.push_back(tri);
-			} // for each triangle
+			obj->mesh = parseMesh(object["triangles"], byHash);
+		}
+		if (object.find("mesh") != object.end()) {
+			std::string name = object["mesh"];
+			if (named.find(name) == named.end()) {
+				std::cout << "Unknown mesh " << name << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			obj->mesh = named[name];
+		}
+		if (obj->type == MESH && obj->mesh == NULL) {
+			json none = json::array();
+			obj->mesh = parseMesh(none, byHash);
+		}
+		if (object.find("transform") != object.end()) {
+			obj->transform = parseTransform(object["transform"]);
+			obj->inverse = glm::inverse(obj->transform);
 		}
 
 		// Material properties
+		Material mat;
 		if (material.find("ambient") != material.end()) {
-			obj->ambient = vector_to_vec3(material["ambient"]);
+			mat.ambient = vector_to_vec3(material["ambient"]);
 		}
 		if (material.find("diffuse") != material.end()) {
-			obj->diffuse = vector_to_vec3(material["diffuse"]);
+			mat.diffuse = vector_to_vec3(material["diffuse"]);
 		}
 		if (material.find("specular") != material.end()) {
-			obj->specular = vector_to_vec3(material["specular"]);
+			mat.specular = vector_to_vec3(material["specular"]);
 		}
 		if (material.find("shininess") != material.end()) {
-			obj->shininess = float(material["shininess"]);
+			mat.shininess = float(material["shininess"]);
 		}
 		if (material.find("reflective") != material.end()) {
-			obj->reflective = vector_to_vec3(material["reflective"]);
+			mat.reflective = vector_to_vec3(material["reflective"]);
 		}
 		if (material.find("transmissive") != material.end()) {
-			obj->transmissive = vector_to_vec3(material["transmissive"]);
+			mat.transmissive = vector_to_vec3(material["transmissive"]);
 		}
 		if (material.find("refraction") != material.end()) {
-			obj->refraction = float(material["refraction"]);
+			mat.refraction = float(material["refraction"]);
 		}
+		obj->material = addMaterial(mat, materialsByHash);
 
+		if (obj->mesh != NULL) {
+			obj->mesh->users++;
+		}
 		objects.push_back(obj);
 	}
+
+	// Quantized meshes give up their full precision triangles, so they can
+	// only be traced through their own bottom-level BVH.
+	for (int m = 0; m < meshes.size(); m++) {
+		Mesh* mesh = meshes[m];
+		if (QUANTIZE_MIN_TRIANGLES > 0 && mesh->tris.size() >= QUANTIZE_MIN_TRIANGLES) {
+			mesh->quantized = new QuantizedMesh(mesh->tris);
+			mesh->tris = TriangleArrays();
+		}
+	}
+
+	// Meshes placed once without a transform go straight into the scene BVH,
+	// everything else is traced through a shared bottom-level BVH.
+	for (int i = 0; i < objects.size(); i++) {
+		Object* obj = objects[i];
+		if (obj->type == MESH && obj->mesh->size() > 0) {
+			obj->instanced = obj->mesh->users > 1 || obj->transform != glm::mat4(1.f) || obj->mesh->quantized != NULL;
+		}
+	}
 }
 
 void populateLights() {
@@ -167,6 +357,235 @@ void populateLights() {
 	}
 }
 
+void buildBVH(BVH& target, const std::vector<Object *>& objs) {
+	if (BVH_BUILDER == BUILD_LBVH) {
+		target.buildLinear(objs);
+	}
+	else if (BVH_BUILDER == BUILD_SBVH) {
+		target.buildSpatial(objs, SBVH_DUPLICATION);
+	}
+	else {
+		target.build(objs);
+	}
+}
+
+// Meshes that need a bottom-level BVH, in a fixed order for the cache.
+// Quantized meshes are left out, as their BVH depends on the order their
+// triangles were put in when it was built, which the cache doesn't keep.
+std::vector<Mesh *> instancedMeshes() {
+	std::vector<Mesh *> result;
+
+	for (int i = 0; i < objects.size(); i++) {
+		Mesh* mesh = objects[i]->mesh;
+		if (objects[i]->instanced && mesh->quantized == NULL && std::find(result.begin(), result.end(), mesh) == result.end()) {
+			result.push_back(mesh);
+		}
+	}
+	return result;
+}
+
+// Everything the BVHs depend on, so a cached copy is only used for the same
+// geometry built the same way.
+unsigned long long geometryKey() {
+	unsigned long long key = hashBytes(&BVH_BUILDER, sizeof(BVH_BUILDER));
+	key = hashBytes(&SBVH_DUPLICATION, sizeof(SBVH_DUPLICATION), key);
+
+	std::map<const Mesh *, int> meshIndex;
+	for (int m = 0; m < meshes.size(); m++) {
+		meshIndex[meshes[m]] = m;
+	}
+
+	for (int i = 0; i < objects.size(); i++) {
+		const Object* object = objects[i];
+		int mesh = (object->mesh != NULL) ? meshIndex[object->mesh] : -1;
+
+		key = hashBytes(&object->type, sizeof(object->type), key);
+		key = hashBytes(&object->pos, sizeof(object->pos), key);
+		key = hashBytes(&object->radius, sizeof(object->radius), key);
+		key = hashBytes(&object->transform, sizeof(object->transform), key);
+		key = hashBytes(&object->instanced, sizeof(object->instanced), key);
+		key = hashBytes(&mesh, sizeof(mesh), key);
+	}
+	for (int m = 0; m < meshes.size(); m++) {
+		const QuantizedMesh* quantized = meshes[m]->quantized;
+		key = hashTriangles(meshes[m]->tris, key);
+		if (quantized != NULL) {
+			key = hashBytes(&quantized->origin, sizeof(quantized->origin), key);
+			key = hashBytes(&quantized->step, sizeof(quantized->step), key);
+			key = hashBytes(quantized->positions.data(), quantized->positions.size() * sizeof(unsigned short), key);
+			key = hashBytes(quantized->indices.data(), quantized->indices.size() * sizeof(unsigned int), key);
+		}
+	}
+	return key;
+}
+
+// Spheres and mesh triangles go into the BVH, planes can't be bounded.
+// Instanced meshes get one BVH per Mesh, built once in mesh space, and the
+// scene BVH above them only holds the instances. With a cacheFile the BVHs
+// are read from there when the geometry matches, and saved there otherwise.
+void buildAcceleration(const std::string& cacheFile = "") {
+	planes.clear();
+
+	for (int i = 0; i < objects.size(); i++) {
+		if (objects[i]->type == PLANE) {
+			Plane plane;
+			plane.pos = objects[i]->pos;
+			plane.normal = objects[i]->normal;
+			plane.object = i;
+			planes.push_back(plane);
+		}
+	}
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<Mesh *> instanced = instancedMeshes();
+	unsigned long long key = 0;
+	if (!cacheFile.empty()) {
+		key = geometryKey();
+	}
+
+	// Quantized meshes are built without decoding them, and are then put in
+	// leaf order. Their BVHs are needed before the cached scene BVH can be
+	// checked against them.
+	int numQuantizedTris = 0;
+	size_t quantizedBytes = 0;
+	for (int m = 0; m < meshes.size(); m++) {
+		Mesh* mesh = meshes[m];
+		if (mesh->quantized == NULL || mesh->blas != NULL) { continue; }
+
+		mesh->blas = new BVH();
+		mesh->blas->buildQuantized(*mesh->quantized);
+
+		numQuantizedTris += mesh->quantized->size();
+		quantizedBytes += mesh->quantized->bytes();
+	}
+
+	bool cached = false;
+	if (!cacheFile.empty()) {
+		cached = loadBVHCache(cacheFile, key, bvh, objects, instanced);
+	}
+
+	int numInstances = 0;
+	int numInstancedTris = 0;
+	for (int i = 0; i < objects.size(); i++) {
+		Object* obj = objects[i];
+		if (!obj->instanced) { continue; }
+		numInstances++;
+
+		if (obj->mesh->blas == NULL) {
+			Object local(MESH);
+			local.mesh = obj->mesh;
+			obj->mesh->blas = new BVH();
+			buildBVH(*obj->mesh->blas, std::vector<Object *>(1, &local));
+			numInstancedTris += obj->mesh->tris.size();
+		}
+	}
+	if (!cached) {
+		buildBVH(bvh, objects);
+
+		if (!cacheFile.empty() && !saveBVHCache(cacheFile, key, bvh, instanced)) {
+			std::cout << "Unable to write BVH cache " << cacheFile << std::endl;
+		}
+	}
+
+	// Scenes of nothing but spheres (and planes) walk a grid faster than any tree.
+	int numSpheres = 0;
+	for (int i = 0; i < objects.size(); i++) {
+		numSpheres += (objects[i]->type == SPHERE) ? 1 : 0;
+	}
+	bool onlySpheres = (numSpheres + planes.size() == objects.size());
+
+	accelerator = ACCELERATOR;
+	if (accelerator == ACCEL_AUTO && onlySpheres && numSpheres >= GRID_MIN_SPHERES) {
+		accelerator = ACCEL_GRID;
+	}
+	if (accelerator == ACCEL_AUTO) {
+		accelerator = cpuHasAVX2() ? ACCEL_BVH8 : (SIMD_X86 ? ACCEL_BVH4 : ACCEL_BVH2);
+	}
+	if (accelerator == ACCEL_BVH8 && !cpuHasAVX2() && SIMD_X86) {
+		std::cout << "BVH8 needs AVX2, falling back to BVH4\n";
+		accelerator = ACCEL_BVH4;
+	}
+
+	bvh4.clear();
+	bvh8.clear();
+	grid.clear();
+	if (accelerator == ACCEL_GRID) {
+		grid.build(bvh);
+		std::cout << "Using a " << grid.res[0] << "x" << grid.res[1] << "x" << grid.res[2] << " grid with "
+			<< grid.cellPrims.size() << " entries\n";
+	}
+	else if (accelerator == ACCEL_BVH4) {
+		bvh4.build(bvh);
+		std::cout << "Using BVH4 with " << bvh4.nodes.size() << " nodes\n";
+	}
+	else if (accelerator == ACCEL_BVH8) {
+		bvh8.build(bvh);
+		std::cout << "Using BVH8 with " << bvh8.nodes.size() << " nodes\n";
+	}
+	else {
+		std::cout << "Using BVH2 with " << bvh.nodes.size() << " nodes\n";
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	const char* builders[] = { "SAH BVH", "LBVH", "SBVH" };
+	std::cout << (cached ? "Loaded " : "Built ") << builders[BVH_BUILDER] << " over "
+		<< bvh.prims.size() << " primitives in " << elapsed.count() << " ms\n";
+	if (numInstances > 0) {
+		std::cout << "  " << numInstances << " mesh instances, " << numInstancedTris << " triangles in new mesh BVHs\n";
+	}
+	if (numQuantizedTris > 0) {
+		std::cout << "  " << numQuantizedTris << " triangles quantized, "
+			<< double(quantizedBytes) / numQuantizedTris << " bytes per triangle\n";
+	}
+}
+
+// Move an object to transform * its original geometry, matching what the
+// BounceTrans and SpinTrans uniforms do on the GPU. Planes are not animated.
+// The BVH is refit around the object and only rebuilt once refits have
+// degraded it too much. Instances only change their transform, since their
+// triangles are shared.
+void animateObject(int index, const glm::mat4& transform) {
+	if (index < 0 || index >= objects.size() || objects[index]->type == PLANE) { return; }
+	Object* object = objects[index];
+
+	if (restPoses.find(index) == restPoses.end()) {
+		RestPose& rest = restPoses[index];
+		rest.pos = object->pos;
+		rest.transform = object->transform;
+		if (object->type == MESH && !object->instanced) {
+			rest.tris = object->mesh->tris;
+		}
+	}
+	const RestPose& rest = restPoses[index];
+
+	object->pos = point3(transform * glm::vec4(rest.pos, 1));
+	if (object->instanced) {
+		object->transform = transform * rest.transform;
+		object->inverse = glm::inverse(object->transform);
+	}
+	else if (object->type == MESH) {
+		for (int j = 0; j < rest.tris.size(); j++) {
+			object->mesh->tris.set(j, point3(transform * glm::vec4(rest.tris.v0(j), 1)),
+								   point3(transform * glm::vec4(rest.tris.edge1(j), 0)),
+								   point3(transform * glm::vec4(rest.tris.edge2(j), 0)));
+		}
+	}
+
+	if (!bvh.refit(objects, index)) {
+		std::cout << "BVH quality dropped to " << bvh.sahCost() << ", rebuilding\n";
+		buildAcceleration();
+	}
+	else if (accelerator == ACCEL_BVH4) {
+		bvh4.refit(bvh.refitted);
+	}
+	else if (accelerator == ACCEL_BVH8) {
+		bvh8.refit(bvh.refitted);
+	}
+	else if (accelerator == ACCEL_GRID) {
+		grid.build(bvh); // Linear in the primitives, no cheaper to patch
+	}
+}
+
 
 void choose_scene(char const* fn) {
 	if (fn == NULL) {
@@ -175,15 +594,26 @@ void choose_scene(char const* fn) {
 	}
 
 	std::cout << "Loading scene " << fn << std::endl;
+	loadScene(fn, readSceneFile(fn));
+}
 
-	std::string fname = PATH + std::string(fn) + ".json";
-	std::fstream in(fname);
+std::string readSceneFile(char const* name) {
+	std::string fname = PATH + std::string(name) + ".json";
+	std::ifstream in(fname, std::ios::binary);
 	if (!in.is_open()) {
 		std::cout << "Unable to open scene file " << fname << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
-	in >> scene;
+	std::stringstream text;
+	text << in.rdbuf();
+	return text.str();
+}
+
+// The BVH cache still goes by name, so workers on the machine that has the
+// scene, or on a shared disk, don't each build it again.
+void loadScene(char const* name, const std::string& text) {
+	scene = json::parse(text);
 
 	json camera = scene["camera"];
 	// these are optional parameters (otherwise they default to the values initialized earlier)
@@ -198,6 +628,7 @@ void choose_scene(char const* fn) {
 
 	populateObjects();
 	populateLights();
+	buildAcceleration(USE_BVH_CACHE ? PATH + std::string(name) + ".bvh" : "");
 }
 
 
@@ -206,7 +637,7 @@ void choose_scene(char const* fn) {
 void printPickingInfo(bool hit, bool pick, int recursionLevel, float& dist, int& hitObj, int& hitTri, point3 clr) {
 	if (pick && recursionLevel == 0) {
 		if (hit) {
-			point3 dif = objects[hitObj]->diffuse;
+			point3 dif = materialTable[objects[hitObj]->material].diffuse;
 			std::cout << "Raycast hit object " << hitObj << " at a distance of " << dist << "\n";
 			std::cout << "      Object's diffuse colour: ( " << dif.r << ", " << dif.g << ", " << dif.b << " )\n";
 			std::cout << "      Final output colour:     ( " << clr.r << ", " << clr.g << ", " << clr.b << " )\n";
@@ -273,102 +704,54 @@ void debugBreakpoints(point3 P, point3 s, point3 V, int recursionLevel) {
 /****************************************************************************/
 
 
-float calcPlaneDistance(point3 A, point3 N, point3 d, point3 e) {
-	float denom = glm::dot(N, d);
-	float t = 0.f;
+bool getIntersection(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) {
+
+	for (int k = 0; k < planes.size(); k++) {
+		float t = intersectPlane(planes[k].pos, planes[k].normal, ray);
 
-	if (denom > 0) {
-		t = glm::dot(N, A - e) / denom;
-		if (t > 0) {
-			t = t;
+		if (t < dist) { // hit the plane
+			dist = t;
+			indexOfClosest = planes[k].object;
+			indexOfTriangle = -1;
 		}
 	}
-	if (denom < 0) {
-		t = glm::dot(N, A - e) / denom;
-	}
-	return t;
-}
 
-float acneThreshold(point3 N, point3 d) {
-	float acneThreshold = ANTI_ACNE;
-	float angleOfIncidenceCos = glm::dot(N, d);
-
-	if (angleOfIncidenceCos > 0) {
-		acneThreshold = ANTI_ACNE / angleOfIncidenceCos;
+	if (accelerator == ACCEL_GRID) {
+		grid.intersect(ray, dist, indexOfClosest, indexOfTriangle);
+	}
+	else if (accelerator == ACCEL_BVH8) {
+		bvh8.intersect(ray, dist, indexOfClosest, indexOfTriangle);
+	}
+	else if (accelerator == ACCEL_BVH4) {
+		bvh4.intersect(ray, dist, indexOfClosest, indexOfTriangle);
+	}
+	else {
+		bvh.intersect(ray, dist, indexOfClosest, indexOfTriangle);
 	}
 
-	return acneThreshold;
+	return (indexOfClosest >= 0);
 }
 
-bool getIntersection(const point3& e, const point3& d, float& dist, int& indexOfClosest, int& indexOfTriangle) {
+// Any-hit version of getIntersection() for shadow rays. The receiving
+// primitive itself (ignoreObject, ignoreTriangle) does not count.
+bool isOccluded(const Ray& ray, int ignoreObject, int ignoreTriangle) {
 
-	for (int i = 0; i < objects.size(); i++) {
-		Object* object = objects[i];
-
-		if (object->type == SPHERE) {
-			point3 pos = object->pos;
-			point3 emc = e - pos;
-			float r = float(object->radius);
-
-			float discriminant = glm::dot(d, emc) * glm::dot(d, emc) - glm::dot(d, d) * (glm::dot(emc, emc) - r * r);
-			float t = FLT_MAX;
-
-			if (discriminant >= 0.f) {
-				// One or two intersections, I don't think I care which.
-				float t1 = (glm::dot(-d, emc) + glm::sqrt(discriminant)) / glm::dot(d, d);
-				float t2 = (glm::dot(-d, emc) - glm::sqrt(discriminant)) / glm::dot(d, d);
-				t1 = (t1 > ANTI_ACNE) ? t1 : FLT_MAX;
-				t2 = (t2 > ANTI_ACNE) ? t2 : FLT_MAX;
-				t = std::min(t1, t2);
-
-				if (t < dist) {
-					dist = t;
-					indexOfClosest = i;
-				}
-			}
-		}
-		else if (object->type == PLANE) {
-			point3 A = object->pos;
-			point3 N = object->normal;
-
-			float t = calcPlaneDistance(A, N, d, e);
-
-			if (t > acneThreshold(N, d)) { // hit the plane
-				if (t < dist) {
-					dist = t;
-					indexOfClosest = i;
-				}
-			}
-		}
-		else if (object->type == MESH) {
-
-			for (int j = 0; j < object->tris.size(); j++) {
-				Triangle* triangle = object->tris[j];
-
-				point3 A = triangle->vertices[0];
-				point3 B = triangle->vertices[1];
-				point3 C = triangle->vertices[2];
-				point3 N = triangle->normal;
+	for (int k = 0; k < planes.size(); k++) {
+		if (planes[k].object == ignoreObject) { continue; }
 
-				float t = calcPlaneDistance(A, N, d, e);
-				point3 X = e + (t * d);
-
-				float inA = glm::dot(glm::cross(B - A, X - A), N);
-				float inB = glm::dot(glm::cross(C - B, X - B), N);
-				float inC = glm::dot(glm::cross(A - C, X - C), N);
-
-				if (t > acneThreshold(N, d) && inA > 0.f && inB > 0.f && inC > 0.f) { // hit front of triangle
-					if (t < dist) {
-						dist = t;
-						indexOfClosest = i;
-						indexOfTriangle = j;
-					}
-				}
-			} // for each triangle
-		}
-	} // for each object
+		if (intersectPlane(planes[k].pos, planes[k].normal, ray) < ray.tmax) { return true; }
+	}
 
-	return (indexOfClosest >= 0);
+	if (accelerator == ACCEL_GRID) {
+		return grid.occluded(ray, ignoreObject, ignoreTriangle);
+	}
+	else if (accelerator == ACCEL_BVH8) {
+		return bvh8.occluded(ray, ignoreObject, ignoreTriangle);
+	}
+	else if (accelerator == ACCEL_BVH4) {
+		return bvh4.occluded(ray, ignoreObject, ignoreTriangle);
+	}
+	return bvh.occluded(ray, ignoreObject, ignoreTriangle);
 }
 
 // ------------------- SHADOW CHECK -----------------------
@@ -378,20 +761,11 @@ bool checkIfInShadow(point3 P, Light *light, point3 lightPos, int indexOfClosest
 	bool isInShadow = false;
 
 	if (light->type > AMBIENT) {
-		float distL = FLT_MAX;
-		int indexObjL = -1;
-		int indexTriL = -1;
+		// P lies at t = 100 along the shadow ray, so anything else hit
+		// before it is in the way. Surfaces touching P are not.
 		point3 shadowRay = (P - lightPos) / 100.f;
-		bool hit = getIntersection(lightPos, shadowRay, distL, indexObjL, indexTriL);
-
-		if (hit) { // should always hit, but there's always room for floating point error.
-			point3 shadowP = lightPos + (distL * shadowRay); // Point of intersection
-
-			//if (glm::distance(P, shadowP) > 0.001) {
-			if (indexObjL != indexOfClosest || indexTriL != indexOfTriangle) {
-				isInShadow = true; // Pretend this light doesn't exist.
-			}
-		}
+		pendingRays++;
+		isInShadow = isOccluded(Ray(lightPos, shadowRay, ANTI_ACNE, 100.f - ANTI_ACNE), indexOfClosest, indexOfTriangle);
 	}
 	return isInShadow;
 }
@@ -424,28 +798,28 @@ bool determineLightDirection(point3 P, Light *light, point3& L, point3& lightPos
 
 
 // Calculate lighting equation at the hit point.
-colour3 phongIllumination(Object* object, Light* light, point3 N, point3 L, point3 V) {
+colour3 phongIllumination(const Material& material, Light* light, point3 N, point3 L, point3 V) {
 	colour3 total = ZEROS;
 
 	// Ambient component
-	if (object->ambient != ZEROS && light->type == AMBIENT) {
-		total += light->colour * object->ambient;
+	if (material.ambient != ZEROS && light->type == AMBIENT) {
+		total += light->colour * material.ambient;
 	}
 
 	// Diffuse component
-	if (object->diffuse != ZEROS && light->type > AMBIENT) {
+	if (material.diffuse != ZEROS && light->type > AMBIENT) {
 		float dotProduct = glm::dot(N, L);
-		total += light->colour * object->diffuse * glm::max(0.f, dotProduct);
+		total += light->colour * material.diffuse * glm::max(0.f, dotProduct);
 	}
 
 	// Specular component
-	if (object->specular != ZEROS && light->type > AMBIENT) {
+	if (material.specular != ZEROS && light->type > AMBIENT) {
 		point3 R = glm::normalize(2.f * glm::dot(N, L) * N - L); // Reflection direction
 		float dotProduct = glm::dot(R, V);
 
 		if (dotProduct > 0) {
-			float shine = glm::pow(dotProduct, object->shininess);
-			total += light->colour * object->specular * shine;
+			float shine = glm::pow(dotProduct, material.shininess);
+			total += light->colour * material.specular * shine;
 		}
 	}
 
@@ -463,61 +837,66 @@ point3 calcNormal(Object *object, point3 P, int indexOfTriangle) {
 		N = glm::normalize(object->normal);
 	}
 	if (object->type == MESH) {
-		Triangle* triangle = object->tris[indexOfTriangle];
-		N = glm::normalize(triangle->normal);
+		N = object->mesh->normal(indexOfTriangle);
+		if (object->instanced) {
+			N = point3(glm::transpose(object->inverse) * glm::vec4(N, 0)); // Normals take the inverse transpose
+		}
+		N = glm::normalize(N);
 	}
 	return N;
 }
 
-colour3 calcReflection(Object* object, point3 P, point3 N, point3 V, bool outside, bool pick, int recursionLevel) {
-	colour3 result = ZEROS;
+// Child rays, appended to rays by the calc functions below and traced by
+// the caller, so that trace() and traceWavefront() share them. Children
+// always come after their parent in the list.
+int spawnRay(std::vector<TraceRay>& rays, int parent, int kind, const point3& P, const point3& R, bool outside) {
+	TraceRay child;
+	child.e = P;
+	child.s = P + R;
+	child.outside = outside;
+	child.level = rays[parent].level + 1;
+	child.kind = kind;
+	child.parent = parent;
+	const Material& material = materialTable[objects[rays[parent].object]->material];
+	child.weight = rays[parent].weight * ((kind == RAY_REFLECTED) ? material.reflective : material.transmissive);
+
+	rays.push_back(child);
+	return int(rays.size()) - 1;
+}
+
+void calcReflection(std::vector<TraceRay>& rays, int index, const Material& material, point3 P, point3 N, point3 V) {
+	const TraceRay& ray = rays[index];
 
-	if (true && object->reflective != ZEROS && recursionLevel < RECURSION_LIMIT && outside) {
+	if (true && material.reflective != ZEROS && ray.level < RECURSION_LIMIT && ray.outside) {
 		point3 R = glm::normalize(2.f * glm::dot(N, V) * N - V); // Reflection direction
 
-		colour3 colourRefl;
-		if (trace(P, P + R, colourRefl, pick, recursionLevel + 1, outside)) {
-			result += colourRefl * object->reflective;
-		}
+		int child = spawnRay(rays, index, RAY_REFLECTED, P, R, ray.outside);
+		rays[index].reflected = child;
 	}
-
-	return result;
 }
 
-colour3 calcTransmission(Object* object, point3 P, point3 V, colour3 total, bool outside, bool pick, int recursionLevel) {
-	colour3 result = total;
-
-	if (true && object->transmissive != ZEROS && object->refraction == 0.f && recursionLevel < RECURSION_LIMIT) {
-
-		bool goingOutside = (object->type == PLANE) ? true : !outside;
+void calcTransmission(std::vector<TraceRay>& rays, int index, Object* object, const Material& material, point3 P, point3 V) {
+	const TraceRay& ray = rays[index];
 
-		point3 R = -V;
-		colour3 colourRefr;
+	if (true && material.transmissive != ZEROS && material.refraction == 0.f && ray.level < RECURSION_LIMIT) {
+		bool goingOutside = (object->type == PLANE) ? true : !ray.outside;
 
-		if (trace(P, P + R, colourRefr, pick, recursionLevel + 1, goingOutside)) {
-			if (outside) {
-				result = total * (1.f - object->transmissive) + colourRefr * object->transmissive;
-			}
-			else {
-				result = colourRefr * object->transmissive;
-			}
-		}
+		int child = spawnRay(rays, index, RAY_TRANSMITTED, P, -V, goingOutside);
+		rays[index].transmitted = child;
 	}
-
-	return result;
 }
 
-colour3 calcRefraction(Object* object, point3 P, point3 N, point3 V, 
-					   colour3 total, bool outside, bool pick, int recursionLevel) {
-	colour3 result = total;
+void calcRefraction(std::vector<TraceRay>& rays, int index, Object* object, const Material& material, point3 P, point3 N, point3 V, bool pick) {
+	const TraceRay& ray = rays[index];
 
-	if (true && object->transmissive != ZEROS && object->refraction != 0.f && recursionLevel < RECURSION_LIMIT) {
+	if (true && material.transmissive != ZEROS && material.refraction != 0.f && ray.level < RECURSION_LIMIT) {
+		bool outside = ray.outside;
 		point3 vEye = -V;
 		point3 norm = (outside) ? N : -N;
 		bool goingOutside = (object->type == PLANE) ? true : !outside;
 
-		float indexInc = (outside) ? 1.f : object->refraction;
-		float indexRef = (goingOutside) ? 1.f : object->refraction;
+		float indexInc = (outside) ? 1.f : material.refraction;
+		float indexRef = (goingOutside) ? 1.f : material.refraction;
 
 		float numeratorPart2 = (1 - glm::pow(glm::dot(vEye, norm), 2));
 		float indicesRatio = (indexInc * indexInc) / (indexRef * indexRef);
@@ -525,68 +904,288 @@ colour3 calcRefraction(Object* object, point3 P, point3 N, point3 V,
 
 		debugPrintRefraction(norm, vEye, V, insideSqrt, indexInc, indexRef, pick);
 
+		int child;
 		if (insideSqrt < 0) { // Total Internal Reflection
 			point3 R = glm::normalize(2.f * glm::dot(norm, V) * norm - V); // Reflection direction
-
-			colour3 colourRefl;
-			if (trace(P, P + R, colourRefl, pick, recursionLevel + 1, outside)) {
-				result = total * (1.f - object->transmissive) + colourRefl * object->transmissive;
-			}
+			child = spawnRay(rays, index, RAY_INTERNAL, P, R, outside);
 		}
 		else { // Refraction
 			point3 numerator1 = indexInc * (vEye - norm * glm::dot(vEye, norm));
 			point3 R = glm::normalize((numerator1 / indexRef) - norm * glm::sqrt(insideSqrt));
+			child = spawnRay(rays, index, RAY_REFRACTED, P, R, goingOutside);
+		}
+		rays[index].transmitted = child;
+	}
+}
 
-			colour3 colourRefr;
-			trace(P, P + R, colourRefr, pick, recursionLevel + 1, goingOutside);
+// Direct light at the closest hit of rays[index], left in its colour, and
+// the reflected and transmitted rays it spawns. This is the first time the
+// hit's material is read.
+void shadeHit(std::vector<TraceRay>& rays, int index, bool pick) {
+	const TraceRay& ray = rays[index];
+	Object *object = objects[ray.object];
+	const Material& material = materialTable[object->material];
+	point3 D = (ray.s - ray.e);
+	colour3 total = colour3(0, 0, 0);
+
+	point3 P = ray.e + (ray.dist * D); // Point of intersection
+	point3 N = calcNormal(object, P, ray.triangle); // Normal at intersection point
+	point3 V = glm::normalize(ray.e - P); // Vector from P to eye.
+
+	for (int i = 0; i < lights.size(); i++) { // For each light
+		Light *light = lights[i];
+		point3 L = point3(0, 0, 0);
+		point3 lightPos = point3(0, 0, 0);
+
+		if (!determineLightDirection(P, light, L, lightPos)) { continue; }
+		if (checkIfInShadow(P, light, lightPos, ray.object, ray.triangle)) { continue; }
+		total += phongIllumination(material, light, N, L, V);
+	}
+	rays[index].colour = total;
+
+	debugPrintHit(object, ray.object, N, P, pick);
+	debugBreakpoints(P, ray.s, V, ray.level);
 
-			result = total * (1.f - object->transmissive) + colourRefr * object->transmissive;
+	calcReflection(rays, index, material, P, N, V);
+	calcTransmission(rays, index, object, material, P, V);
+	calcRefraction(rays, index, object, material, P, N, V, pick);
+}
+
+// Fold the finished colours of the children of rays[index] into its own.
+// Reflections only add when they hit something. Transmitted rays blend in
+// when they hit, and refracted rays always do, the background included.
+void combineRay(std::vector<TraceRay>& rays, int index) {
+	TraceRay& ray = rays[index];
+
+	if (ray.object < 0) {
+		ray.colour = background_colour;
+		return;
+	}
+	const Material& material = materialTable[objects[ray.object]->material];
+	colour3 total = ray.colour;
+
+	colour3 reflection = ZEROS;
+	if (ray.reflected >= 0 && rays[ray.reflected].object >= 0) {
+		reflection += rays[ray.reflected].colour * material.reflective;
+	}
+	total += reflection;
+
+	if (ray.transmitted >= 0) {
+		const TraceRay& child = rays[ray.transmitted];
+		bool childHit = (child.object >= 0);
+
+		if (child.kind == RAY_TRANSMITTED && childHit) {
+			if (ray.outside) {
+				total = total * (1.f - material.transmissive) + child.colour * material.transmissive;
+			}
+			else {
+				total = child.colour * material.transmissive;
+			}
+		}
+		else if ((child.kind == RAY_INTERNAL && childHit) || child.kind == RAY_REFRACTED) {
+			total = total * (1.f - material.transmissive) + child.colour * material.transmissive;
 		}
 	}
-	return result;
+	ray.colour = total;
+}
+
+void intersectRay(TraceRay& ray) {
+	pendingRays++;
+	getIntersection(Ray(ray.e, ray.s - ray.e), ray.dist, ray.object, ray.triangle);
 }
 
+// Rays that can't add much to their pixel, as in f.glsl, are still
+// intersected so that their parent blends the same way, but they are not
+// shaded and nothing is traced past them. Their colour counts as black.
+bool worthShading(const TraceRay& ray) {
+	return ray.object >= 0 && glm::length(ray.weight) > WORTH_RECURSING;
+}
+
+// Trace everything rays[0] spawns from an explicit stack, reflections
+// first like the recursion this replaced, then fold the colours back up.
+// Children always come after their parent, so one pass from the back
+// finishes every ray before its parent reads it. rays[0] has to be
+// intersected already.
+void traceTree(std::vector<TraceRay>& rays, bool pick) {
+	int stack[TRACE_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0) {
+		int index = stack[--top];
+		if (index > 0) {
+			intersectRay(rays[index]);
+		}
+		if (!worthShading(rays[index])) { continue; }
+
+		shadeHit(rays, index, pick);
+		if (rays[index].transmitted >= 0) { stack[top++] = rays[index].transmitted; }
+		if (rays[index].reflected >= 0) { stack[top++] = rays[index].reflected; }
+	}
+
+	for (int i = int(rays.size()) - 1; i >= 0; i--) {
+		combineRay(rays, i);
+	}
 
+	TraceRay& ray = rays[0];
+	printPickingInfo(ray.object >= 0, pick, ray.level, ray.dist, ray.object, ray.triangle, ray.colour);
+}
+
+void flushRayCount() {
+	rayCount += pendingRays;
+	pendingRays = 0;
+}
+
+long long raysTraced() {
+	return rayCount.load();
+}
+
+int raysInLastTrace() {
+	return lastTraceRays;
+}
 
 bool trace(const point3& e, const point3& s, colour3& colour, bool pick, int recursionLevel, bool outside) {
-	colour = background_colour;
-	float dist = FLT_MAX;
-	point3 D = (s - e);
-	int indexOfClosest = -1;
-	int indexOfTriangle = -1;
-	
-	bool hit = getIntersection(e, D, dist, indexOfClosest, indexOfTriangle);
+	static thread_local std::vector<TraceRay> rays; // Kept between calls, to save the allocation
+	rays.assign(1, TraceRay());
+	rays[0].e = e;
+	rays[0].s = s;
+	rays[0].outside = outside;
+	rays[0].level = recursionLevel;
+
+	intersectRay(rays[0]);
+	traceTree(rays, pick);
+	colour = rays[0].colour;
+	lastTraceRays = int(rays.size());
+	flushRayCount();
+	return rays[0].object >= 0;
+}
 
-	if (hit) {
-		colour3 total = colour3(0, 0, 0);
-		Object *object = objects[indexOfClosest];
+// Primary rays from e through s[0, count) go down the binary BVH as one
+// packet, whichever accelerator is selected. Planes are still tested per ray,
+// and shading, shadows and secondary rays go one ray at a time since those
+// rays no longer share an origin.
+void tracePacket(const point3& e, const point3* s, int count, colour3* colours) {
+	while (count > MAX_PACKET_RAYS) {
+		tracePacket(e, s, MAX_PACKET_RAYS, colours);
+		s += MAX_PACKET_RAYS;
+		colours += MAX_PACKET_RAYS;
+		count -= MAX_PACKET_RAYS;
+	}
 
-		point3 P = e + (dist * D); // Point of intersection
-		point3 N = calcNormal(object, P, indexOfTriangle); // Normal at intersection point
-		point3 V = glm::normalize(e - P); // Vector from P to eye.
-		
-		for (int i = 0; i < lights.size(); i++) { // For each light
-			Light *light = lights[i];
-			point3 L = point3(0, 0, 0);
-			point3 lightPos = point3(0, 0, 0);
+	RayPacket packet;
+	packet.e = e;
+	packet.count = count;
 
-			if (!determineLightDirection(P, light, L, lightPos)) { continue; }
-			if (checkIfInShadow(P, light, lightPos, indexOfClosest, indexOfTriangle)) { continue; }
-			total += phongIllumination(object, light, N, L, V);
+	for (int i = 0; i < count; i++) {
+		packet.rays[i] = Ray(e, s[i] - e);
+		packet.dist[i] = FLT_MAX;
+		packet.object[i] = -1;
+		packet.triangle[i] = -1;
+
+		for (int k = 0; k < planes.size(); k++) {
+			float t = intersectPlane(planes[k].pos, planes[k].normal, packet.rays[i]);
+
+			if (t < packet.dist[i]) {
+				packet.dist[i] = t;
+				packet.object[i] = planes[k].object;
+			}
 		}
+	}
 
-		debugPrintHit(object, indexOfClosest, N, P, pick);
-		debugBreakpoints(P, s, V, recursionLevel);
+	bvh.intersectPacket(packet);
+	pendingRays += count;
 
-		total += calcReflection(object, P, N, V, outside, pick, recursionLevel);
-		total = calcTransmission(object, P, V, total, outside, pick, recursionLevel);
-		total = calcRefraction(object, P, N, V, total, outside, pick, recursionLevel);
+	std::vector<TraceRay> rays;
+	for (int i = 0; i < count; i++) {
+		rays.assign(1, TraceRay());
+		rays[0].e = e;
+		rays[0].s = s[i];
+		rays[0].dist = packet.dist[i];
+		rays[0].object = packet.object[i];
+		rays[0].triangle = packet.triangle[i];
 
-		colour = total;
+		traceTree(rays, false);
+		colours[i] = rays[0].colour;
 	}
+	flushRayCount();
+}
 
-	printPickingInfo(hit, pick, recursionLevel, dist, indexOfClosest, indexOfTriangle, colour);
+/****************************************************************************/
+/********************************* Wavefront ********************************/
+/****************************************************************************/
+
+// Reorder the stream rays[begin, end) by direction octant, then by the
+// Morton code of the origin within the stream's bounds, so that rays next to
+// each other in memory walk the same nodes and touch the same primitives.
+// Parents are pointed at the new positions. Streams are a tile's rays, sorted
+// on the thread tracing the tile.
+void sortStream(std::vector<TraceRay>& rays, int begin, int end) {
+	point3 lo(FLT_MAX, FLT_MAX, FLT_MAX);
+	point3 hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int i = begin; i < end; i++) {
+		lo = glm::min(lo, rays[i].e);
+		hi = glm::max(hi, rays[i].e);
+	}
+	point3 scale = 1.f / glm::max(hi - lo, point3(FLT_MIN, FLT_MIN, FLT_MIN));
+
+	std::vector<unsigned int> keys(end - begin);
+	std::vector<int> index(end - begin);
+	for (int i = begin; i < end; i++) {
+		point3 D = rays[i].s - rays[i].e;
+		unsigned int octant = (D.x < 0 ? 4 : 0) | (D.y < 0 ? 2 : 0) | (D.z < 0 ? 1 : 0);
+		keys[i - begin] = (octant << 29) | (mortonCode30((rays[i].e - lo) * scale) >> 1);
+		index[i - begin] = i;
+	}
+	radixSort(keys, index, 1); // Already on one of the render threads
 
-	return hit;
+	std::vector<TraceRay> sorted(end - begin);
+	for (int k = 0; k < sorted.size(); k++) {
+		sorted[k] = rays[index[k]];
+	}
+	for (int k = 0; k < sorted.size(); k++) {
+		TraceRay& ray = rays[begin + k];
+		ray = sorted[k];
+		int& slot = (ray.kind == RAY_REFLECTED) ? rays[ray.parent].reflected : rays[ray.parent].transmitted;
+		slot = begin + k;
+	}
 }
 
+// Every bounce depth is one stream: all of it is intersected, then shaded,
+// which spawns the next depth's stream. Colours are combined back up the ray
+// trees once the deepest stream is done, giving the same result as trace()
+// for each ray. Primary rays keep the caller's order, since they share an
+// origin and a tile of them is already coherent. Later streams are sorted.
+void traceWavefront(const point3& e, const point3* s, int count, colour3* colours) {
+	std::vector<TraceRay> rays(count);
+	for (int i = 0; i < count; i++) {
+		rays[i].e = e;
+		rays[i].s = s[i];
+	}
+
+	int begin = 0;
+	int end = count;
+
+	while (begin < end) {
+		if (begin > 0) {
+			sortStream(rays, begin, end);
+		}
+		for (int i = begin; i < end; i++) {
+			intersectRay(rays[i]);
+		}
+		for (int i = begin; i < end; i++) {
+			if (worthShading(rays[i])) {
+				shadeHit(rays, i, false);
+			}
+		}
+		begin = end;
+		end = int(rays.size());
+	}
+
+	for (int i = int(rays.size()) - 1; i >= 0; i--) {
+		combineRay(rays, i);
+	}
+	for (int i = 0; i < count; i++) {
+		colours[i] = rays[i].colour;
+	}
+	flushRayCount();
+}
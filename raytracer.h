@@ -1,10 +1,30 @@
 #include <glm/glm.hpp>
+#include <string>
 
 typedef glm::vec3 point3;
 typedef glm::vec3 colour3;
 
+// Acceleration structures getIntersection() can use.
+enum { ACCEL_AUTO, ACCEL_BVH2, ACCEL_BVH4, ACCEL_BVH8, ACCEL_GRID };
+// How the BVH is built: best tree (SAH), fastest build (Morton-sorted LBVH),
+// or SAH with spatial splits for scenes of large, overlapping triangles.
+enum { BUILD_SAH, BUILD_LBVH, BUILD_SBVH };
+
 extern double fov;
 extern colour3 background_colour;
+extern int ACCELERATOR; // ACCEL_AUTO picks the grid for many spheres, else the widest BVH the CPU supports
+extern int BVH_BUILDER;
+extern float SBVH_DUPLICATION; // Extra references BUILD_SBVH may add, as a fraction of the primitives
+extern bool USE_BVH_CACHE; // Keep built BVHs in scenes/<name>.bvh between runs
+extern float WORTH_RECURSING; // Secondary rays that can add less than this to a pixel are not shaded
+extern int QUANTIZE_MIN_TRIANGLES; // Meshes this large are stored quantized (see quantized.h), 0 never
 
 void choose_scene(char const *fn);
+std::string readSceneFile(char const *name); // Text of scenes/<name>.json, exits if there is none
+void loadScene(char const *name, const std::string &text); // choose_scene() for the text of scenes/<name>.json, as a worker gets it over the network
+void animateObject(int index, const glm::mat4 &transform);
 bool trace(const point3 &e, const point3 &s, colour3 &colour, bool pick, int recursionLevel, bool outside);
+void tracePacket(const point3 &e, const point3 *s, int count, colour3 *colours); // trace() for primary rays from one eye, in 4x4 or 8x8 tiles
+void traceWavefront(const point3 &e, const point3 *s, int count, colour3 *colours); // trace() for primary rays from one eye, one bounce depth at a time
+long long raysTraced(); // Primary, secondary and shadow rays the trace functions have cast so far, on all threads
+int raysInLastTrace(); // Primary and secondary rays of this thread's last trace(), 1 when nothing was reflected or refracted
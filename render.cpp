@@ -0,0 +1,1002 @@
+// Headless CPU renderer for machines without a display. Loads a scene the
+// same way the window does, traces every pixel with trace() on all cores and
+// writes the image as a binary PPM.
+//
+//   render <scene> [-size width height] [-threads n] [-tile size] [-o file.ppm]
+//          [-packet | -wavefront] [-accel bvh2|bvh4|bvh8|grid|auto]
+//          [-builder sah|lbvh|sbvh [-duplication f]] [-nocache]
+//          [-progressive [-budget ms] [-quality error] [-samples n] [-previews]]
+//          [-adaptive n [-contrast c]] [-listen port [-chunk size]]
+//   render -worker host:port [-threads n] [-tile size]
+//
+// -packet traces each tile's primary rays as 8x8 packets with tracePacket(),
+// which walk the BVH together. -wavefront traces each tile with
+// traceWavefront(), one bounce depth of all its rays at a time.
+//
+// -accel and -builder pick the acceleration structure and how its BVH is
+// built, instead of the widest BVH the CPU supports built with the SAH.
+// -duplication is the fraction of extra references the spatial split builder
+// may add. -nocache builds the BVH every run rather than keeping it in
+// scenes/<name>.bvh.
+//
+// -progressive traces a coarse image first and refines it, then keeps adding
+// samples per pixel until the time budget runs out, the estimated error
+// drops below the target or every pixel has the maximum number of samples.
+// -previews rewrites the output after every pass.
+//
+// -adaptive traces one sample per pixel, then adds up to n more only where
+// the image needs them: pixels that differ from a neighbour by more than the
+// contrast threshold, or by half of it where the ray was reflected or
+// refracted. Those keep sampling, four at a time, while their variance says
+// the mean is still uncertain.
+//
+// -listen makes this process the coordinator of a render spread over other
+// processes or machines. Workers started with -worker connect to it, at any
+// time during the render, and get the scene's JSON and the image size. The
+// coordinator hands out chunks of the image two at a time, along the same
+// Hilbert curve as the tiles, and puts the chunks of a worker whose
+// connection drops back in the queue. Once the queue is empty, workers with
+// nothing to do take copies of chunks still out on others, so a stalled
+// worker doesn't hold up the image. For example, on one machine:
+//
+//   render c -size 7680 4320 -listen 7000 &
+//   for i in 1 2 3 4; do render -worker localhost:7000 -threads 2 & done
+//
+// Built by the render target of the Makefile, which defines HEADLESS.
+
+#include "common.h"
+#include "raytracer.h"
+#include "parallel.h"
+#include "net.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+int WIDTH = 512; // Same as the window
+int HEIGHT = 512;
+int THREADS = 0; // 0 for one per core
+int TILE_SIZE = 16; // Pixels along each side of the square tiles threads render
+std::string OUTPUT;
+
+bool PACKETS = false; // Trace primary rays in 8x8 packets
+bool WAVEFRONT = false; // Trace each tile a bounce depth at a time
+
+bool PROGRESSIVE = false;
+double BUDGET_MS = 0.0; // Wall clock time for the whole progressive render, 0 for no limit
+float QUALITY = 0.f; // Stop once the RMS standard error of the pixel luminances is below this
+int MAX_SAMPLES = 64; // Per pixel
+bool PREVIEWS = false;
+
+int ADAPTIVE_SAMPLES = 0; // Extra samples a pixel may get, 0 for none
+float ADAPTIVE_CONTRAST = 0.1f; // Largest difference from a neighbour, per displayed channel, a pixel is left alone with
+float ADAPTIVE_ERROR = 0.01f; // Refined pixels stop once the standard error of their luminance is below this
+const int ADAPTIVE_BATCH = 4; // Samples added to a refined pixel between variance checks
+
+int LISTEN_PORT = 0; // Coordinate workers that connect to this port, 0 to render here
+std::string COORDINATOR; // host:port of the coordinator, when this process is a worker
+int CHUNK_SIZE = 64; // Pixels along each side of the square chunks handed to workers
+const int CHUNKS_IN_FLIGHT = 2; // Per worker, so its next chunk is already there when it sends one back
+const int MESSAGE_TIMEOUT_MS = 5000; // A worker that stops sending or reading a message this long is dropped
+const int CONNECT_TIMEOUT_MS = 10000; // Workers may start before the coordinator listens
+const int PROTOCOL_VERSION = 1;
+
+// Messages between the coordinator and its workers.
+enum {
+	MSG_SCENE = 1, // Version, scene name, scene JSON, width, height
+	MSG_READY, // Worker's thread count, once it has loaded the scene
+	MSG_TILE, // Chunk number, left, bottom, width, height
+	MSG_PIXELS, // Chunk number, rays traced, then r, g, b of every pixel row by row
+	MSG_DONE
+};
+
+const double PI = 3.14159265358979323846;
+const int PREVIEW_STRIDE = 16; // The first progressive pass traces one pixel in this many squared
+
+typedef std::chrono::steady_clock Clock;
+
+//----------------------------------------------------------------------------
+
+// Point on the image plane at z = -1 through (x, y) in pixels from the
+// bottom left corner, as s() in q1.cpp makes it for the window. Pixel (i, j)
+// has its centre at (i + 0.5, j + 0.5).
+point3 s(float x, float y) {
+	float aspect_ratio = (float)WIDTH / HEIGHT;
+	float h = (float)std::tan((PI * fov) / 180.0 / 2.0);
+	float w = h * aspect_ratio;
+
+	float u = -w + 2.f * w * x / WIDTH;
+	float v = -h + 2.f * h * y / HEIGHT;
+
+	return point3(u, v, -1.f);
+}
+
+// Cell (x, y) at distance d along the Hilbert curve through an n x n grid,
+// n a power of two.
+void hilbertCell(int n, int d, int& x, int& y) {
+	x = 0;
+	y = 0;
+	for (int size = 1; size < n; size *= 2) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = size - 1 - x;
+				y = size - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += size * rx;
+		y += size * ry;
+		d /= 4;
+	}
+}
+
+// Corners of the tiles in Hilbert order, so that tiles next to each other in
+// the list are next to each other in the image and trace through the same
+// part of the scene.
+std::vector<int> tileOrder(int tilesX, int tilesY) {
+	int n = 1;
+	while (n < tilesX || n < tilesY) { n *= 2; }
+
+	std::vector<int> tiles;
+	for (int d = 0; d < n * n; d++) {
+		int x, y;
+		hilbertCell(n, d, x, y);
+		if (x < tilesX && y < tilesY) {
+			tiles.push_back(y * tilesX + x);
+		}
+	}
+	return tiles;
+}
+
+// Call visit(x0, y0, x1, y1) for every tile [x0, x1) x [y0, y1) of the width
+// by height region at (left, bottom). Tiles are split between the threads
+// along the Hilbert curve, and threads that finish their share steal tiles
+// from the others, so expensive regions such as glass don't leave the rest of
+// the threads waiting. Tiles not started by the deadline are skipped. The
+// threads' work is added to stats.
+template <typename F>
+void forEachTileIn(int left, int bottom, int width, int height, int threads,
+				   std::vector<WorkerStats>& stats, Clock::time_point deadline, F visit) {
+	int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	std::vector<int> tiles = tileOrder(tilesX, tilesY);
+
+	std::vector<WorkerStats> pass;
+	parallelTasks(int(tiles.size()), [&](int task) {
+		if (Clock::now() > deadline) { return; }
+		int x0 = left + (tiles[task] % tilesX) * TILE_SIZE;
+		int y0 = bottom + (tiles[task] / tilesX) * TILE_SIZE;
+		visit(x0, y0, std::min(x0 + TILE_SIZE, left + width), std::min(y0 + TILE_SIZE, bottom + height));
+	}, pass, threads);
+
+	stats.resize(pass.size());
+	for (int t = 0; t < pass.size(); t++) {
+		stats[t].busy += pass[t].busy;
+		stats[t].idle += pass[t].idle;
+		stats[t].tasks += pass[t].tasks;
+		stats[t].stolen += pass[t].stolen;
+	}
+}
+
+// Call visit(x, y) for every pixel of the region, a tile at a time.
+template <typename F>
+void forEachPixelIn(int left, int bottom, int width, int height, int threads,
+					std::vector<WorkerStats>& stats, Clock::time_point deadline, F visit) {
+	forEachTileIn(left, bottom, width, height, threads, stats, deadline, [&](int x0, int y0, int x1, int y1) {
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				visit(x, y);
+			}
+		}
+	});
+}
+
+template <typename F>
+void forEachPixel(int threads, std::vector<WorkerStats>& stats, Clock::time_point deadline, F visit) {
+	forEachPixelIn(0, 0, WIDTH, HEIGHT, threads, stats, deadline, visit);
+}
+
+// Each tile is traced as packets of up to 8x8 pixels.
+void renderPackets(std::vector<colour3>& image, int threads, std::vector<WorkerStats>& stats) {
+	const point3 eye(0.f, 0.f, 0.f);
+	const int PACKET_SIZE = 8; // Pixels along each side, MAX_PACKET_RAYS in all
+
+	forEachTileIn(0, 0, WIDTH, HEIGHT, threads, stats, Clock::time_point::max(), [&](int x0, int y0, int x1, int y1) {
+		point3 points[PACKET_SIZE * PACKET_SIZE];
+		colour3 colours[PACKET_SIZE * PACKET_SIZE];
+
+		for (int py = y0; py < y1; py += PACKET_SIZE) {
+			for (int px = x0; px < x1; px += PACKET_SIZE) {
+				int count = 0;
+				for (int y = py; y < std::min(py + PACKET_SIZE, y1); y++) {
+					for (int x = px; x < std::min(px + PACKET_SIZE, x1); x++) {
+						points[count++] = s(x + 0.5f, y + 0.5f);
+					}
+				}
+				tracePacket(eye, points, count, colours);
+
+				count = 0;
+				for (int y = py; y < std::min(py + PACKET_SIZE, y1); y++) {
+					for (int x = px; x < std::min(px + PACKET_SIZE, x1); x++) {
+						image[y * WIDTH + x] = colours[count++];
+					}
+				}
+			}
+		}
+	});
+}
+
+// Each tile is one wavefront of primary rays.
+void renderWavefront(std::vector<colour3>& image, int threads, std::vector<WorkerStats>& stats) {
+	const point3 eye(0.f, 0.f, 0.f);
+
+	forEachTileIn(0, 0, WIDTH, HEIGHT, threads, stats, Clock::time_point::max(), [&](int x0, int y0, int x1, int y1) {
+		std::vector<point3> points;
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				points.push_back(s(x + 0.5f, y + 0.5f));
+			}
+		}
+		std::vector<colour3> colours(points.size());
+		traceWavefront(eye, &points[0], int(points.size()), &colours[0]);
+
+		int k = 0;
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				image[y * WIDTH + x] = colours[k++];
+			}
+		}
+	});
+}
+
+void renderImage(std::vector<colour3>& image, int threads, std::vector<WorkerStats>& stats) {
+	const point3 eye(0.f, 0.f, 0.f);
+
+	forEachPixel(threads, stats, Clock::time_point::max(), [&](int x, int y) {
+		colour3 colour;
+		trace(eye, s(x + 0.5f, y + 0.5f), colour, false, 0, true);
+		image[y * WIDTH + x] = colour;
+	});
+}
+
+/****************************************************************************/
+
+// Float framebuffer the progressive mode adds samples to. Squared
+// luminances are summed as well, for the standard error of each pixel.
+class Accumulator {
+public:
+	std::vector<colour3> sum;
+	std::vector<float> sumSquares;
+	std::vector<int> samples;
+
+	Accumulator(int pixels) : sum(pixels, colour3(0.f)), sumSquares(pixels, 0.f), samples(pixels, 0) {}
+
+	void add(int i, const colour3& colour) {
+		float y = luminance(colour);
+		sum[i] += colour;
+		sumSquares[i] += y * y;
+		samples[i]++;
+	}
+
+	// Variance of the mean luminance of pixel i, from the spread of its samples.
+	float meanVariance(int i) const {
+		int n = samples[i];
+		if (n < 2) { return 0.f; }
+		float y = luminance(sum[i]);
+		float variance = std::max(0.f, (sumSquares[i] - y * y / n) / (n - 1));
+		return variance / n;
+	}
+
+	static float luminance(const colour3& c) {
+		return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+	}
+};
+
+// Mean of each pixel's samples. Pixels the coarse passes haven't reached
+// yet repeat the nearest coarser pixel that has been traced.
+void resolve(const Accumulator& acc, std::vector<colour3>& image) {
+	for (int y = 0; y < HEIGHT; y++) {
+		for (int x = 0; x < WIDTH; x++) {
+			int source = y * WIDTH + x;
+			for (int stride = 2; acc.samples[source] == 0 && stride <= PREVIEW_STRIDE; stride *= 2) {
+				source = (y - y % stride) * WIDTH + (x - x % stride);
+			}
+			int n = acc.samples[source];
+			image[y * WIDTH + x] = (n > 0) ? acc.sum[source] / float(n) : colour3(0.f);
+		}
+	}
+}
+
+// Root mean square over the pixels of the standard error of their mean.
+float estimateError(const Accumulator& acc) {
+	double total = 0.0;
+	for (int i = 0; i < acc.samples.size(); i++) {
+		total += acc.meanVariance(i);
+	}
+	return float(std::sqrt(total / std::max(int(acc.samples.size()), 1)));
+}
+
+// Base b radical inverse of i, the i-th point of a Halton sequence.
+float radicalInverse(int b, int i) {
+	float inverse = 1.f / b;
+	float scale = inverse;
+	float result = 0.f;
+	for (; i > 0; i /= b) {
+		result += (i % b) * scale;
+		scale *= inverse;
+	}
+	return result;
+}
+
+// Offset of sample pass within pixel (x, y). Every pass takes the next point
+// of the 2, 3 Halton sequence, shifted by a fixed amount per pixel so that
+// neighbouring pixels don't share the same pattern.
+void sampleOffset(int x, int y, int pass, float& dx, float& dy) {
+	unsigned int h = unsigned(x) * 73856093u ^ unsigned(y) * 19349663u;
+	h ^= h >> 16; h *= 0x7feb352du;
+	h ^= h >> 15; h *= 0x846ca68bu;
+	h ^= h >> 16;
+
+	dx = radicalInverse(2, pass) + (h & 0xFFFF) / 65536.f;
+	dy = radicalInverse(3, pass) + (h >> 16) / 65536.f;
+	dx -= std::floor(dx);
+	dy -= std::floor(dy);
+}
+
+bool writePPM(const std::string& path, const std::vector<colour3>& image);
+
+// Coarse to fine first: every PREVIEW_STRIDE-th pixel on both axes, then the
+// pixels on the grid of half that spacing not traced yet, and so on down to
+// every pixel, all through their centres. The image then matches
+// renderImage(), and later passes add one sample per pixel at a time.
+void renderProgressive(Accumulator& acc, int threads, std::vector<WorkerStats>& stats, Clock::time_point start) {
+	const point3 eye(0.f, 0.f, 0.f);
+	Clock::time_point deadline = Clock::time_point::max();
+	if (BUDGET_MS > 0.0) {
+		deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(BUDGET_MS));
+	}
+	std::vector<colour3> image(WIDTH * HEIGHT);
+
+	// Error estimates need two samples per pixel, so only sample passes print one.
+	auto finishPass = [&](const char* what, int pass) {
+		double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		float error = estimateError(acc);
+		if (error > 0.f) { printf("  %s %d done at %.1f ms, error %.5f\n", what, pass, ms, error); }
+		else { printf("  %s %d done at %.1f ms\n", what, pass, ms); }
+		if (PREVIEWS) {
+			resolve(acc, image);
+			writePPM(OUTPUT, image);
+		}
+		return error;
+	};
+
+	int pass = 0;
+	for (int stride = PREVIEW_STRIDE; stride >= 1 && Clock::now() < deadline; stride /= 2) {
+		forEachPixel(threads, stats, deadline, [&](int x, int y) {
+			if (x % stride != 0 || y % stride != 0) { return; }
+			if (stride < PREVIEW_STRIDE && x % (2 * stride) == 0 && y % (2 * stride) == 0) { return; } // Traced already
+
+			colour3 colour;
+			trace(eye, s(x + 0.5f, y + 0.5f), colour, false, 0, true);
+			acc.add(y * WIDTH + x, colour);
+		});
+		finishPass("coarse pass", ++pass);
+	}
+
+	for (int sample = 1; sample < MAX_SAMPLES && Clock::now() < deadline; sample++) {
+		forEachPixel(threads, stats, deadline, [&](int x, int y) {
+			float dx, dy;
+			sampleOffset(x, y, sample, dx, dy);
+
+			colour3 colour;
+			trace(eye, s(x + dx, y + dy), colour, false, 0, true);
+			acc.add(y * WIDTH + x, colour);
+		});
+		float error = finishPass("sample pass", sample);
+		if (QUALITY > 0.f && error <= QUALITY) { break; }
+	}
+}
+
+// Largest difference, per channel of the displayed colour, between pixel
+// (x, y) and its eight neighbours.
+float neighbourContrast(const std::vector<colour3>& image, int x, int y) {
+	colour3 centre = glm::min(glm::max(image[y * WIDTH + x], colour3(0.f)), colour3(1.f));
+	float contrast = 0.f;
+
+	for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, HEIGHT - 1); ny++) {
+		for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, WIDTH - 1); nx++) {
+			colour3 other = glm::min(glm::max(image[ny * WIDTH + nx], colour3(0.f)), colour3(1.f));
+			colour3 d = glm::abs(other - centre);
+			contrast = std::max(contrast, std::max(d.r, std::max(d.g, d.b)));
+		}
+	}
+	return contrast;
+}
+
+// One sample through each pixel's centre, as renderImage() takes, then
+// batches of extra samples where the first pass found edges, reflections or
+// refraction, placed like the progressive mode's so they stay stratified.
+void renderAdaptive(Accumulator& acc, int threads, std::vector<WorkerStats>& stats) {
+	const point3 eye(0.f, 0.f, 0.f);
+	const Clock::time_point never = Clock::time_point::max();
+	std::vector<unsigned char> secondary(WIDTH * HEIGHT);
+
+	forEachPixel(threads, stats, never, [&](int x, int y) {
+		colour3 colour;
+		trace(eye, s(x + 0.5f, y + 0.5f), colour, false, 0, true);
+		acc.add(y * WIDTH + x, colour);
+		secondary[y * WIDTH + x] = raysInLastTrace() > 1;
+	});
+
+	std::vector<colour3> image(acc.sum);
+	std::vector<unsigned char> refine(WIDTH * HEIGHT);
+	int refined = 0;
+	for (int y = 0; y < HEIGHT; y++) {
+		for (int x = 0; x < WIDTH; x++) {
+			int i = y * WIDTH + x;
+			float threshold = secondary[i] ? ADAPTIVE_CONTRAST / 2.f : ADAPTIVE_CONTRAST;
+			refine[i] = neighbourContrast(image, x, y) > threshold;
+			refined += refine[i];
+		}
+	}
+	printf("  %d of %d pixels refined\n", refined, WIDTH * HEIGHT);
+
+	for (int first = 1; first <= ADAPTIVE_SAMPLES && refined > 0; first += ADAPTIVE_BATCH) {
+		int last = std::min(first + ADAPTIVE_BATCH - 1, ADAPTIVE_SAMPLES);
+
+		forEachPixel(threads, stats, never, [&](int x, int y) {
+			int i = y * WIDTH + x;
+			if (!refine[i]) { return; }
+
+			for (int sample = first; sample <= last; sample++) {
+				float dx, dy;
+				sampleOffset(x, y, sample, dx, dy);
+
+				colour3 colour;
+				trace(eye, s(x + dx, y + dy), colour, false, 0, true);
+				acc.add(i, colour);
+			}
+		});
+
+		refined = 0;
+		for (int i = 0; i < refine.size(); i++) {
+			refine[i] = refine[i] && acc.meanVariance(i) > ADAPTIVE_ERROR * ADAPTIVE_ERROR;
+			refined += refine[i];
+		}
+		printf("  %d pixels still uncertain after %d extra samples\n", refined, last);
+	}
+}
+
+void printWorkerStats(const std::vector<WorkerStats>& stats) {
+	double busy = 0.0;
+	double idle = 0.0;
+	for (int t = 0; t < stats.size(); t++) {
+		const WorkerStats& worker = stats[t];
+		printf("  thread %2d: busy %8.1f ms, idle %7.1f ms, %5d tiles, %4d stolen\n",
+			   t, worker.busy * 1000.0, worker.idle * 1000.0, worker.tasks, worker.stolen);
+		busy += worker.busy;
+		idle += worker.idle;
+	}
+	printf("  threads busy %.1f%% of the time\n", 100.0 * busy / std::max(busy + idle, 1e-9));
+}
+
+// Binary PPM, top row first. Written to a temporary file and renamed, so a
+// viewer watching the previews never reads half an image.
+bool writePPM(const std::string& path, const std::vector<colour3>& image) {
+	std::string temp = path + ".tmp";
+	FILE* out = fopen(temp.c_str(), "wb");
+	if (out == NULL) { return false; }
+
+	fprintf(out, "P6\n%d %d\n255\n", WIDTH, HEIGHT);
+	std::vector<unsigned char> row(3 * WIDTH);
+	for (int y = HEIGHT - 1; y >= 0; y--) {
+		for (int x = 0; x < WIDTH; x++) {
+			for (int c = 0; c < 3; c++) {
+				float value = glm::clamp(image[y * WIDTH + x][c], 0.f, 1.f);
+				row[3 * x + c] = (unsigned char)(value * 255.f + 0.5f);
+			}
+		}
+		fwrite(row.data(), 1, row.size(), out);
+	}
+	bool ok = !ferror(out);
+	ok = (fclose(out) == 0) && ok;
+
+	if (ok && std::rename(temp.c_str(), path.c_str()) != 0) {
+		std::remove(path.c_str()); // Windows will not rename over an existing file
+		ok = std::rename(temp.c_str(), path.c_str()) == 0;
+	}
+	if (!ok) {
+		std::remove(temp.c_str());
+	}
+	return ok;
+}
+
+// Index of name in names, or -1.
+int findName(const char* name, const char* const* names, int count) {
+	for (int i = 0; i < count; i++) {
+		if (strcmp(name, names[i]) == 0) { return i; }
+	}
+	return -1;
+}
+
+void usage() {
+	std::cout << "Usage: render <scene> [-size width height] [-threads n] [-tile size] [-o file.ppm]\n"
+		<< "                [-packet | -wavefront] [-accel bvh2|bvh4|bvh8|grid|auto]\n"
+		<< "                [-builder sah|lbvh|sbvh [-duplication f]] [-nocache]\n"
+		<< "                [-progressive [-budget ms] [-quality error] [-samples n] [-previews]]\n"
+		<< "                [-adaptive n [-contrast c]] [-listen port [-chunk size]]\n"
+		<< "       render -worker host:port [-threads n] [-tile size]\n";
+	exit(EXIT_FAILURE);
+}
+
+/****************************************************************************/
+
+class Chunk {
+public:
+	int x, y, width, height;
+	bool done = false;
+	int copies = 0; // Workers rendering it now
+};
+
+class RemoteWorker {
+public:
+	Connection connection;
+	bool ready = false;
+	int threads = 0;
+	std::vector<int> chunks; // Handed out and not back yet
+	int rendered = 0;
+	long long rays = 0;
+};
+
+// Coordinator side: hand out chunks of the image to whichever workers
+// connect, until every chunk is back. Returns the rays the workers traced.
+long long renderDistributed(const char* name, const std::string& text, std::vector<colour3>& image) {
+	std::vector<Chunk> chunks;
+	int chunksX = (WIDTH + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	int chunksY = (HEIGHT + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	std::deque<int> queue;
+	std::vector<int> order = tileOrder(chunksX, chunksY);
+	for (int k = 0; k < order.size(); k++) {
+		Chunk chunk;
+		chunk.x = (order[k] % chunksX) * CHUNK_SIZE;
+		chunk.y = (order[k] / chunksX) * CHUNK_SIZE;
+		chunk.width = std::min(CHUNK_SIZE, WIDTH - chunk.x);
+		chunk.height = std::min(CHUNK_SIZE, HEIGHT - chunk.y);
+		chunks.push_back(chunk);
+		queue.push_back(k);
+	}
+
+	Listener listener;
+	if (!listener.listen(LISTEN_PORT)) {
+		std::cout << "Unable to listen on port " << LISTEN_PORT << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::cout << "Waiting for workers on port " << LISTEN_PORT << std::endl;
+
+	MessageWriter scene;
+	scene.putInt(PROTOCOL_VERSION);
+	scene.putString(name);
+	scene.putString(text);
+	scene.putInt(WIDTH);
+	scene.putInt(HEIGHT);
+
+	std::vector<RemoteWorker> workers; // Lost ones stay, closed, for the summary
+	int remaining = int(chunks.size());
+	std::vector<long long> handles;
+	std::vector<bool> readable;
+	int type;
+	std::vector<unsigned char> payload;
+
+	while (remaining > 0) {
+		handles.assign(1, listener.handle);
+		for (int w = 0; w < workers.size(); w++) {
+			handles.push_back(workers[w].connection.handle);
+		}
+		waitReadable(handles, 1000, readable);
+
+		if (readable[0]) {
+			RemoteWorker worker;
+			worker.connection = listener.accept();
+			worker.connection.setTimeout(MESSAGE_TIMEOUT_MS);
+			if (worker.connection.send(MSG_SCENE, scene.bytes)) {
+				std::cout << "  worker " << workers.size() << " connected" << std::endl;
+				workers.push_back(worker);
+			}
+			else {
+				worker.connection.close();
+			}
+		}
+
+		for (int w = 0; w < workers.size(); w++) {
+			RemoteWorker& worker = workers[w];
+			if (!readable[w + 1] || !worker.connection.receive(type, payload)) { continue; }
+			MessageReader in(payload);
+
+			if (type == MSG_READY) {
+				worker.threads = in.getInt();
+				worker.ready = in.ok;
+			}
+			else if (type == MSG_PIXELS) {
+				int id = in.getInt();
+				long long rays = in.getLong();
+				auto held = std::find(worker.chunks.begin(), worker.chunks.end(), id);
+				if (!in.ok || held == worker.chunks.end() ||
+					payload.size() != in.at + 12 * size_t(chunks[id].width) * chunks[id].height) {
+					worker.connection.close(); // Not what it was asked for
+					continue;
+				}
+				worker.chunks.erase(held);
+				worker.rays += rays;
+				Chunk& chunk = chunks[id];
+				chunk.copies--;
+				if (chunk.done) { continue; } // Another copy came back first
+
+				for (int y = chunk.y; y < chunk.y + chunk.height; y++) {
+					for (int x = chunk.x; x < chunk.x + chunk.width; x++) {
+						colour3& colour = image[y * WIDTH + x];
+						colour.r = in.getFloat();
+						colour.g = in.getFloat();
+						colour.b = in.getFloat();
+					}
+				}
+				chunk.done = true;
+				worker.rendered++;
+				remaining--;
+			}
+			else {
+				worker.connection.close();
+			}
+		}
+
+		for (int w = 0; w < workers.size(); w++) {
+			RemoteWorker& worker = workers[w];
+			while (worker.ready && worker.connection.open() && worker.chunks.size() < CHUNKS_IN_FLIGHT) {
+				while (!queue.empty() && chunks[queue.front()].done) {
+					queue.pop_front();
+				}
+
+				int next = -1;
+				if (!queue.empty()) {
+					next = queue.front();
+					queue.pop_front();
+				}
+				else if (worker.chunks.empty()) {
+					// Copy the unfinished chunk fewest workers have, in case theirs stalled.
+					for (int k = 0; k < chunks.size(); k++) {
+						if (!chunks[k].done && (next < 0 || chunks[k].copies < chunks[next].copies)) { next = k; }
+					}
+				}
+				if (next < 0) { break; }
+
+				const Chunk& chunk = chunks[next];
+				MessageWriter tile;
+				tile.putInt(next);
+				tile.putInt(chunk.x);
+				tile.putInt(chunk.y);
+				tile.putInt(chunk.width);
+				tile.putInt(chunk.height);
+				if (!worker.connection.send(MSG_TILE, tile.bytes)) {
+					worker.connection.close(); // Dropped below, with the chunks it already had
+					queue.push_front(next);
+					break;
+				}
+				chunks[next].copies++;
+				worker.chunks.push_back(next);
+			}
+		}
+
+		// Whatever the workers that went away had is handed out again.
+		for (int w = 0; w < workers.size(); w++) {
+			RemoteWorker& worker = workers[w];
+			if (worker.connection.open() || worker.chunks.empty()) { continue; }
+			for (int k = 0; k < worker.chunks.size(); k++) {
+				Chunk& chunk = chunks[worker.chunks[k]];
+				chunk.copies--;
+				if (!chunk.done && chunk.copies == 0) { queue.push_front(worker.chunks[k]); }
+			}
+			std::cout << "  worker " << w << " lost, " << worker.chunks.size() << " chunks handed out again" << std::endl;
+			worker.chunks.clear();
+		}
+	}
+
+	// Workers may still be sending a chunk, or a copy of one, so each is told
+	// it is done and read from until it hangs up, rather than reset. Stalled
+	// ones are given up on after MESSAGE_TIMEOUT_MS.
+	for (int w = 0; w < workers.size(); w++) {
+		workers[w].connection.send(MSG_DONE, std::vector<unsigned char>());
+		workers[w].connection.shutdownSend();
+	}
+	Clock::time_point giveUp = Clock::now() + std::chrono::milliseconds(MESSAGE_TIMEOUT_MS);
+	bool draining = true;
+	while (draining && Clock::now() < giveUp) {
+		draining = false;
+		handles.clear();
+		for (int w = 0; w < workers.size(); w++) {
+			handles.push_back(workers[w].connection.handle);
+			draining = draining || workers[w].connection.open();
+		}
+		waitReadable(handles, 100, readable);
+		for (int w = 0; w < workers.size(); w++) {
+			if (readable[w]) { workers[w].connection.receive(type, payload); } // Closes once the worker has
+		}
+	}
+
+	long long rays = 0;
+	for (int w = 0; w < workers.size(); w++) {
+		RemoteWorker& worker = workers[w];
+		worker.connection.close();
+		printf("  worker %2d: %2d threads, %5d chunks, %lld rays\n", w, worker.threads, worker.rendered, worker.rays);
+		rays += worker.rays;
+	}
+	listener.close();
+	return rays;
+}
+
+// Worker side: load the scene the coordinator sends, then render the chunks
+// it asks for until it says it is done.
+int runWorker(const std::string& coordinator, int threads) {
+	size_t colon = coordinator.rfind(':');
+	if (colon == std::string::npos) { usage(); }
+	std::string host = coordinator.substr(0, colon);
+	int port = atoi(coordinator.c_str() + colon + 1);
+
+	Connection connection = connectTo(host, port);
+	Clock::time_point giveUp = Clock::now() + std::chrono::milliseconds(CONNECT_TIMEOUT_MS);
+	while (!connection.open() && Clock::now() < giveUp) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		connection = connectTo(host, port);
+	}
+	if (!connection.open()) {
+		std::cout << "Unable to connect to " << coordinator << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	int type;
+	std::vector<unsigned char> payload;
+	if (!connection.receive(type, payload) || type != MSG_SCENE) {
+		std::cout << "No scene from " << coordinator << std::endl;
+		return EXIT_FAILURE;
+	}
+	MessageReader scene(payload);
+	int version = scene.getInt();
+	std::string name = scene.getString();
+	std::string text = scene.getString();
+	WIDTH = scene.getInt();
+	HEIGHT = scene.getInt();
+	if (!scene.ok || version != PROTOCOL_VERSION) {
+		std::cout << "The coordinator at " << coordinator << " runs a different version of render" << std::endl;
+		return EXIT_FAILURE;
+	}
+	// The name picks the file the scene's BVH is cached in, which must stay in scenes/
+	if (name.empty() || name.find_first_of("/\\") != std::string::npos || name.find("..") != std::string::npos) {
+		std::cout << "The coordinator at " << coordinator << " sent an invalid scene name" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "Loading scene " << name << " for " << coordinator << std::endl;
+	loadScene(name.c_str(), text);
+	MessageWriter ready;
+	ready.putInt(threads);
+	connection.send(MSG_READY, ready.bytes);
+
+	const point3 eye(0.f, 0.f, 0.f);
+	std::vector<WorkerStats> stats;
+	std::vector<colour3> pixels;
+	int rendered = 0;
+	std::deque<std::vector<unsigned char> > queued;
+	std::vector<long long> handle(1, connection.handle);
+	std::vector<bool> readable;
+	bool finished = false;
+
+	while (connection.open()) {
+		// Read every message already here first, so chunks the coordinator
+		// sent before it finished aren't rendered for nothing.
+		waitReadable(handle, 0, readable);
+		if (queued.empty() || readable[0]) {
+			if (!connection.receive(type, payload)) { break; }
+			finished = (type == MSG_DONE);
+			if (type != MSG_TILE) { break; }
+			queued.push_back(payload);
+			continue;
+		}
+		payload.swap(queued.front());
+		queued.pop_front();
+
+		MessageReader in(payload);
+		int id = in.getInt();
+		int x0 = in.getInt();
+		int y0 = in.getInt();
+		int width = in.getInt();
+		int height = in.getInt();
+		if (!in.ok || x0 < 0 || y0 < 0 || width <= 0 || height <= 0 || x0 + width > WIDTH || y0 + height > HEIGHT) { break; }
+
+		pixels.resize(width * height);
+		long long raysBefore = raysTraced();
+		forEachPixelIn(x0, y0, width, height, threads, stats, Clock::time_point::max(), [&](int x, int y) {
+			colour3 colour;
+			trace(eye, s(x + 0.5f, y + 0.5f), colour, false, 0, true);
+			pixels[(y - y0) * width + (x - x0)] = colour;
+		});
+
+		MessageWriter out;
+		out.bytes.reserve(12 + 12 * pixels.size());
+		out.putInt(id);
+		out.putLong(raysTraced() - raysBefore);
+		for (int i = 0; i < pixels.size(); i++) {
+			out.putFloat(pixels[i].r);
+			out.putFloat(pixels[i].g);
+			out.putFloat(pixels[i].b);
+		}
+		if (!connection.send(MSG_PIXELS, out.bytes)) {
+			// The coordinator may have finished and hung up while this chunk
+			// was rendering, in which case its MSG_DONE is still to be read.
+			while (!finished && connection.receive(type, payload)) {
+				finished = (type == MSG_DONE);
+			}
+			break;
+		}
+		rendered++;
+	}
+
+	connection.close();
+	std::cout << "Rendered " << rendered << " chunks" << (finished ? "" : ", then lost the coordinator") << std::endl;
+	printWorkerStats(stats);
+	return finished ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+	const char* scene = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-size") == 0 && i + 2 < argc) {
+			WIDTH = atoi(argv[++i]);
+			HEIGHT = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			THREADS = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-tile") == 0 && i + 1 < argc) {
+			TILE_SIZE = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			OUTPUT = argv[++i];
+		}
+		else if (strcmp(argv[i], "-packet") == 0) {
+			PACKETS = true;
+		}
+		else if (strcmp(argv[i], "-wavefront") == 0) {
+			WAVEFRONT = true;
+		}
+		else if (strcmp(argv[i], "-accel") == 0 && i + 1 < argc) {
+			const char* names[] = { "auto", "bvh2", "bvh4", "bvh8", "grid" }; // In ACCEL_ order
+			ACCELERATOR = findName(argv[++i], names, 5);
+			if (ACCELERATOR < 0) { usage(); }
+		}
+		else if (strcmp(argv[i], "-builder") == 0 && i + 1 < argc) {
+			const char* names[] = { "sah", "lbvh", "sbvh" }; // In BUILD_ order
+			BVH_BUILDER = findName(argv[++i], names, 3);
+			if (BVH_BUILDER < 0) { usage(); }
+		}
+		else if (strcmp(argv[i], "-duplication") == 0 && i + 1 < argc) {
+			SBVH_DUPLICATION = float(atof(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-nocache") == 0) {
+			USE_BVH_CACHE = false;
+		}
+		else if (strcmp(argv[i], "-progressive") == 0) {
+			PROGRESSIVE = true;
+		}
+		else if (strcmp(argv[i], "-budget") == 0 && i + 1 < argc) {
+			BUDGET_MS = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-quality") == 0 && i + 1 < argc) {
+			QUALITY = float(atof(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-samples") == 0 && i + 1 < argc) {
+			MAX_SAMPLES = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-previews") == 0) {
+			PREVIEWS = true;
+		}
+		else if (strcmp(argv[i], "-adaptive") == 0 && i + 1 < argc) {
+			ADAPTIVE_SAMPLES = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-contrast") == 0 && i + 1 < argc) {
+			ADAPTIVE_CONTRAST = float(atof(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-listen") == 0 && i + 1 < argc) {
+			LISTEN_PORT = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-chunk") == 0 && i + 1 < argc) {
+			CHUNK_SIZE = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-worker") == 0 && i + 1 < argc) {
+			COORDINATOR = argv[++i];
+		}
+		else if (argv[i][0] != '-' && scene == NULL) {
+			scene = argv[i];
+		}
+		else {
+			usage();
+		}
+	}
+	if (WIDTH <= 0 || HEIGHT <= 0 || TILE_SIZE <= 0 || MAX_SAMPLES <= 0 || ADAPTIVE_SAMPLES < 0) { usage(); }
+	if (PROGRESSIVE && ADAPTIVE_SAMPLES > 0) { usage(); }
+	if ((PACKETS || WAVEFRONT) && (PROGRESSIVE || ADAPTIVE_SAMPLES > 0 || LISTEN_PORT > 0)) { usage(); }
+	if (PACKETS && WAVEFRONT) { usage(); }
+	if (SBVH_DUPLICATION < 0.f) { usage(); }
+	if (LISTEN_PORT > 0 && (PROGRESSIVE || ADAPTIVE_SAMPLES > 0 || CHUNK_SIZE <= 0)) { usage(); }
+	int threads = (THREADS > 0) ? THREADS : numThreads();
+	if (!COORDINATOR.empty()) {
+		if (scene != NULL || LISTEN_PORT > 0) { usage(); }
+		return runWorker(COORDINATOR, threads);
+	}
+	if (OUTPUT.empty()) {
+		OUTPUT = std::string(scene != NULL ? scene : "c") + ".ppm";
+	}
+
+	Clock::time_point start = Clock::now();
+	choose_scene(scene); // The coordinator too, which checks the scene and leaves its BVH in the cache for workers
+	Clock::time_point loaded = Clock::now();
+
+	std::vector<colour3> image(WIDTH * HEIGHT);
+	std::vector<WorkerStats> stats;
+	long long raysBefore = raysTraced();
+	long long workerRays = 0;
+	if (LISTEN_PORT > 0) {
+		const char* name = (scene != NULL) ? scene : "c";
+		workerRays = renderDistributed(name, readSceneFile(name), image);
+	}
+	else if (PROGRESSIVE) {
+		Accumulator acc(WIDTH * HEIGHT);
+		renderProgressive(acc, threads, stats, loaded);
+		resolve(acc, image);
+	}
+	else if (ADAPTIVE_SAMPLES > 0) {
+		Accumulator acc(WIDTH * HEIGHT);
+		renderAdaptive(acc, threads, stats);
+		resolve(acc, image);
+	}
+	else if (PACKETS) {
+		renderPackets(image, threads, stats);
+	}
+	else if (WAVEFRONT) {
+		renderWavefront(image, threads, stats);
+	}
+	else {
+		renderImage(image, threads, stats);
+	}
+	Clock::time_point rendered = Clock::now();
+	long long rays = raysTraced() - raysBefore + workerRays;
+
+	if (!writePPM(OUTPUT, image)) {
+		std::cout << "Unable to write " << OUTPUT << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::chrono::duration<double> loadTime = loaded - start;
+	std::chrono::duration<double> renderTime = rendered - loaded;
+	std::cout << "Rendered " << WIDTH << "x" << HEIGHT;
+	if (LISTEN_PORT > 0) {
+		std::cout << " on workers";
+	}
+	else {
+		std::cout << " on " << threads << " threads";
+	}
+	std::cout << " in " << renderTime.count() * 1000.0 << " ms (scene loaded in " << loadTime.count() * 1000.0 << " ms)\n";
+	std::cout << "  " << rays << " rays, " << rays / renderTime.count() / 1e6 << " Mrays/s\n";
+	if (LISTEN_PORT == 0) {
+		printWorkerStats(stats);
+	}
+	std::cout << "Wrote " << OUTPUT << std::endl;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,384 @@
+// Spatial split BVH, following Stich, Friedrich and Dietrich, "Spatial Splits
+// in Bounding Volume Hierarchies" (HPG 2009). Where the best object split
+// leaves two children that overlap a lot, planes that cut through primitives
+// are tried as well. A primitive cut by the chosen plane goes into both
+// children, each copy bounded by its own side of the plane. Leaves still test
+// the whole primitive, so a hit found through either copy is correct.
+
+#include "bvh.h"
+
+#include <algorithm>
+
+const int OBJECT_BINS = 12;
+const int SPATIAL_BINS = 16;
+const int MAX_LEAF_PRIMS = 4;
+const int MAX_DEPTH = 60; // Well inside BVH_STACK_SIZE
+const int MAX_NODE_PRIMS = 65535; // LinearBVHNode::numPrims is 16 bits
+const float TRAVERSAL_COST = 1.f; // Relative to one primitive test
+const float MIN_OVERLAP = 1e-5f; // Child overlap, relative to the root area, before spatial splits are tried
+
+
+/****************************************************************************/
+
+static bool isEmpty(const AABB& b) {
+	return b.min.x > b.max.x || b.min.y > b.max.y || b.min.z > b.max.z;
+}
+
+static AABB intersection(const AABB& a, const AABB& b) {
+	AABB o;
+	o.min = glm::max(a.min, b.min);
+	o.max = glm::min(a.max, b.max);
+	return isEmpty(o) ? AABB() : o;
+}
+
+static AABB merged(AABB a, const AABB& b) {
+	a.grow(b);
+	return a;
+}
+
+class Split {
+public:
+	float cost = FLT_MAX;
+	int axis = 0;
+	int bin = -1; // Plane sits before this bin
+	AABB left;
+	AABB right;
+};
+
+// Recursive builder working on lists of references, which are primitives
+// whose bounds may have been clipped by earlier spatial splits.
+class SpatialSplitBuilder {
+public:
+	const std::vector<Object *>& objs;
+	std::vector<Primitive>& out; // References in leaf order
+	int budget; // Duplicate references that may still be created
+	float rootArea = 0.f;
+
+	SpatialSplitBuilder(const std::vector<Object *>& o, std::vector<Primitive>& p, int b) : objs(o), out(p), budget(b) {}
+
+	BVHNode* build(std::vector<Primitive>& refs, int depth);
+
+private:
+	void splitReference(const Primitive& ref, int axis, float pos, AABB& left, AABB& right) const;
+	Split findObjectSplit(const std::vector<Primitive>& refs, const AABB& centroidBounds, int axis) const;
+	Split findSpatialSplit(const std::vector<Primitive>& refs, const AABB& bounds) const;
+	bool partitionSpatial(std::vector<Primitive>& refs, const Split& split, const AABB& bounds,
+						  std::vector<Primitive>& left, std::vector<Primitive>& right);
+	BVHNode* makeLeaf(BVHNode* node, const std::vector<Primitive>& refs);
+};
+
+// Bounds of the parts of a reference on either side of the plane. Triangles
+// are clipped exactly, spheres and instances just have their box cut.
+void SpatialSplitBuilder::splitReference(const Primitive& ref, int axis, float pos, AABB& left, AABB& right) const {
+	left = AABB();
+	right = AABB();
+
+	if (ref.triangle >= 0) {
+		const TriangleArrays& tris = objs[ref.object]->mesh->tris;
+
+		for (int v = 0; v < 3; v++) {
+			point3 a = tris.vertex(ref.triangle, v);
+			point3 b = tris.vertex(ref.triangle, (v + 1) % 3);
+
+			if (a[axis] <= pos) { left.grow(a); }
+			if (a[axis] >= pos) { right.grow(a); }
+
+			if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+				point3 p = a + ((pos - a[axis]) / (b[axis] - a[axis])) * (b - a);
+				p[axis] = pos;
+				left.grow(p);
+				right.grow(p);
+			}
+		}
+	}
+	else {
+		left = ref.bounds;
+		right = ref.bounds;
+	}
+
+	left.max[axis] = std::min(left.max[axis], pos);
+	right.min[axis] = std::max(right.min[axis], pos);
+	left = intersection(left, ref.bounds);
+	right = intersection(right, ref.bounds);
+}
+
+// Binned SAH over the centroids, the same as BVH::buildRecursive().
+Split SpatialSplitBuilder::findObjectSplit(const std::vector<Primitive>& refs, const AABB& centroidBounds, int axis) const {
+	Split best;
+	best.axis = axis;
+	float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+
+	int binCounts[OBJECT_BINS] = { 0 };
+	AABB binBounds[OBJECT_BINS];
+	for (int i = 0; i < refs.size(); i++) {
+		int b = int(OBJECT_BINS * ((refs[i].centroid[axis] - centroidBounds.min[axis]) / extent));
+		b = std::min(b, OBJECT_BINS - 1);
+		binCounts[b]++;
+		binBounds[b].grow(refs[i].bounds);
+	}
+
+	AABB rightBounds[OBJECT_BINS];
+	int rightCount[OBJECT_BINS];
+	AABB right;
+	int countR = 0;
+	for (int b = OBJECT_BINS - 1; b > 0; b--) {
+		right.grow(binBounds[b]);
+		countR += binCounts[b];
+		rightBounds[b] = right;
+		rightCount[b] = countR;
+	}
+
+	AABB left;
+	int countL = 0;
+	for (int b = 1; b < OBJECT_BINS; b++) {
+		left.grow(binBounds[b - 1]);
+		countL += binCounts[b - 1];
+		if (countL == 0 || rightCount[b] == 0) { continue; }
+
+		float cost = countL * left.surfaceArea() + rightCount[b] * rightBounds[b].surfaceArea();
+		if (cost < best.cost) {
+			best.cost = cost;
+			best.bin = b;
+			best.left = left;
+			best.right = rightBounds[b];
+		}
+	}
+	return best;
+}
+
+// Binned spatial SAH on every axis. Each reference is chopped into the bins
+// it covers, and counted as entering its first bin and leaving its last.
+Split SpatialSplitBuilder::findSpatialSplit(const std::vector<Primitive>& refs, const AABB& bounds) const {
+	Split best;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float lo = bounds.min[axis];
+		float width = bounds.max[axis] - lo;
+		if (width <= 0.f) { continue; }
+
+		AABB binBounds[SPATIAL_BINS];
+		int entries[SPATIAL_BINS] = { 0 };
+		int exits[SPATIAL_BINS] = { 0 };
+
+		for (int i = 0; i < refs.size(); i++) {
+			int first = int(SPATIAL_BINS * ((refs[i].bounds.min[axis] - lo) / width));
+			int last = int(SPATIAL_BINS * ((refs[i].bounds.max[axis] - lo) / width));
+			first = std::min(std::max(first, 0), SPATIAL_BINS - 1);
+			last = std::min(std::max(last, first), SPATIAL_BINS - 1);
+
+			Primitive rest = refs[i];
+			for (int b = first; b < last; b++) {
+				AABB piece;
+				AABB remainder;
+				splitReference(rest, axis, lo + width * (b + 1) / SPATIAL_BINS, piece, remainder);
+				binBounds[b].grow(piece);
+				rest.bounds = remainder;
+			}
+			binBounds[last].grow(rest.bounds);
+			entries[first]++;
+			exits[last]++;
+		}
+
+		AABB rightBounds[SPATIAL_BINS];
+		int rightCount[SPATIAL_BINS];
+		AABB right;
+		int countR = 0;
+		for (int b = SPATIAL_BINS - 1; b > 0; b--) {
+			right.grow(binBounds[b]);
+			countR += exits[b];
+			rightBounds[b] = right;
+			rightCount[b] = countR;
+		}
+
+		AABB left;
+		int countL = 0;
+		for (int b = 1; b < SPATIAL_BINS; b++) {
+			left.grow(binBounds[b - 1]);
+			countL += entries[b - 1];
+			if (countL == 0 || rightCount[b] == 0) { continue; }
+
+			float cost = countL * left.surfaceArea() + rightCount[b] * rightBounds[b].surfaceArea();
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.bin = b;
+				best.left = left;
+				best.right = rightBounds[b];
+			}
+		}
+	}
+	return best;
+}
+
+// Sort references to the sides of the plane. One that straddles it is only
+// duplicated if that is cheaper than moving it whole to either side (Stich's
+// reference unsplitting), and never once the budget is used up.
+bool SpatialSplitBuilder::partitionSpatial(std::vector<Primitive>& refs, const Split& split, const AABB& bounds,
+										   std::vector<Primitive>& left, std::vector<Primitive>& right) {
+	int axis = split.axis;
+	float pos = bounds.min[axis] + (bounds.max[axis] - bounds.min[axis]) * split.bin / SPATIAL_BINS;
+	std::vector<Primitive> straddling;
+	AABB leftBounds;
+	AABB rightBounds;
+
+	for (int i = 0; i < refs.size(); i++) {
+		if (refs[i].bounds.max[axis] <= pos) {
+			left.push_back(refs[i]);
+			leftBounds.grow(refs[i].bounds);
+		}
+		else if (refs[i].bounds.min[axis] >= pos) {
+			right.push_back(refs[i]);
+			rightBounds.grow(refs[i].bounds);
+		}
+		else {
+			straddling.push_back(refs[i]);
+		}
+	}
+
+	int countL = left.size() + straddling.size();
+	int countR = right.size() + straddling.size();
+	std::vector<AABB> pieces(2 * straddling.size());
+	for (int i = 0; i < straddling.size(); i++) {
+		splitReference(straddling[i], axis, pos, pieces[2 * i], pieces[2 * i + 1]);
+		leftBounds.grow(pieces[2 * i]);
+		rightBounds.grow(pieces[2 * i + 1]);
+	}
+
+	for (int i = 0; i < straddling.size(); i++) {
+		const Primitive& ref = straddling[i];
+		const AABB& l = pieces[2 * i];
+		const AABB& r = pieces[2 * i + 1];
+
+		float splitCost = leftBounds.surfaceArea() * countL + rightBounds.surfaceArea() * countR;
+		float leftCost = merged(leftBounds, ref.bounds).surfaceArea() * countL + rightBounds.surfaceArea() * (countR - 1);
+		float rightCost = leftBounds.surfaceArea() * (countL - 1) + merged(rightBounds, ref.bounds).surfaceArea() * countR;
+
+		if (isEmpty(r) || (!isEmpty(l) && leftCost <= rightCost && (leftCost < splitCost || budget <= 0))) {
+			left.push_back(ref);
+			leftBounds.grow(ref.bounds);
+			countR--;
+		}
+		else if (isEmpty(l) || rightCost < splitCost || budget <= 0) {
+			right.push_back(ref);
+			rightBounds.grow(ref.bounds);
+			countL--;
+		}
+		else {
+			Primitive piece = ref;
+			piece.bounds = l;
+			piece.centroid = l.centroid();
+			left.push_back(piece);
+			piece.bounds = r;
+			piece.centroid = r.centroid();
+			right.push_back(piece);
+			budget--;
+		}
+	}
+
+	return !left.empty() && !right.empty();
+}
+
+BVHNode* SpatialSplitBuilder::makeLeaf(BVHNode* node, const std::vector<Primitive>& refs) {
+	node->firstPrim = out.size();
+	node->numPrims = refs.size();
+	out.insert(out.end(), refs.begin(), refs.end());
+	return node;
+}
+
+BVHNode* SpatialSplitBuilder::build(std::vector<Primitive>& refs, int depth) {
+	BVHNode* node = new BVHNode();
+	AABB centroidBounds;
+
+	for (int i = 0; i < refs.size(); i++) {
+		node->bounds.grow(refs[i].bounds);
+		centroidBounds.grow(refs[i].centroid);
+	}
+	if (depth == 0) {
+		rootArea = node->bounds.surfaceArea();
+	}
+
+	int count = refs.size();
+	int axis = centroidBounds.maxExtent();
+	float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+
+	if (count <= 1 || ((depth >= MAX_DEPTH || extent <= 0.f) && count <= MAX_NODE_PRIMS)) {
+		return makeLeaf(node, refs);
+	}
+
+	std::vector<Primitive> left;
+	std::vector<Primitive> right;
+
+	if (extent <= 0.f) { // Too many to fit in one leaf, split them arbitrarily
+		left.assign(refs.begin(), refs.begin() + count / 2);
+		right.assign(refs.begin() + count / 2, refs.end());
+	}
+	else {
+		Split objectSplit = findObjectSplit(refs, centroidBounds, axis);
+		Split spatialSplit;
+
+		AABB overlap = intersection(objectSplit.left, objectSplit.right);
+		if (budget > 0 && !isEmpty(overlap) && overlap.surfaceArea() > MIN_OVERLAP * rootArea) {
+			spatialSplit = findSpatialSplit(refs, node->bounds);
+		}
+
+		float bestCost = std::min(objectSplit.cost, spatialSplit.cost);
+		float leafCost = float(count);
+		float splitCost = TRAVERSAL_COST + bestCost / node->bounds.surfaceArea();
+
+		if (bestCost == FLT_MAX || (count <= MAX_LEAF_PRIMS && leafCost <= splitCost)) {
+			return makeLeaf(node, refs);
+		}
+
+		int budgetBefore = budget;
+		bool spatial = spatialSplit.cost < objectSplit.cost &&
+			partitionSpatial(refs, spatialSplit, node->bounds, left, right);
+
+		if (spatial) {
+			axis = spatialSplit.axis;
+		}
+		else {
+			budget = budgetBefore;
+			left.clear();
+			right.clear();
+			for (int i = 0; i < count; i++) {
+				int b = int(OBJECT_BINS * ((refs[i].centroid[axis] - centroidBounds.min[axis]) / extent));
+				(std::min(b, OBJECT_BINS - 1) < objectSplit.bin ? left : right).push_back(refs[i]);
+			}
+
+			// Binning put everything on one side through rounding, fall back to a median split.
+			if (left.empty() || right.empty()) {
+				std::nth_element(refs.begin(), refs.begin() + count / 2, refs.end(), [&](const Primitive& a, const Primitive& b) {
+					return a.centroid[axis] < b.centroid[axis];
+				});
+				left.assign(refs.begin(), refs.begin() + count / 2);
+				right.assign(refs.begin() + count / 2, refs.end());
+			}
+		}
+	}
+
+	std::vector<Primitive>().swap(refs); // Children hold their own copies from here on
+
+	node->axis = axis;
+	node->children[0] = build(left, depth + 1);
+	node->children[1] = build(right, depth + 1);
+	return node;
+}
+
+/****************************************************************************/
+
+void BVH::buildSpatial(const std::vector<Object *>& objs, float duplication) {
+	clear();
+	gatherPrimitives(objs);
+
+	if (!prims.empty()) {
+		std::vector<Primitive> refs;
+		refs.swap(prims);
+
+		SpatialSplitBuilder builder(objs, prims, int(refs.size() * duplication));
+		BVHNode* root = builder.build(refs, 0);
+		flatten(root);
+		delete root;
+		pack(objs);
+	}
+	prepareRefit(objs.size());
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// Helpers for the hand-vectorized kernels. The build does not pass any -m
+// flags, so the AVX2 code is compiled per function and only run after CPUID
+// says the machine has it. SSE2 is always there on x86-64.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define SIMD_X86 1
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#else
+#  define SIMD_X86 0
+#endif
+
+// Wrap AVX2 functions in SIMD_BEGIN_AVX2 / SIMD_END so that gcc and clang
+// accept the intrinsics. MSVC compiles them for any target as long as they
+// are not called on hardware without AVX2. FMA is left off on purpose, since
+// contracting a*b+c in the inlined intersection tests would change results.
+#if defined(__clang__)
+#  define SIMD_BEGIN_AVX2 _Pragma("clang attribute push (__attribute__((target(\"avx2\"))), apply_to = function)")
+#  define SIMD_BEGIN_SSE41 _Pragma("clang attribute push (__attribute__((target(\"sse4.1\"))), apply_to = function)")
+#  define SIMD_END _Pragma("clang attribute pop")
+#elif defined(__GNUC__)
+#  define SIMD_BEGIN_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2\")")
+#  define SIMD_BEGIN_SSE41 _Pragma("GCC push_options") _Pragma("GCC target(\"sse4.1\")")
+#  define SIMD_END _Pragma("GCC pop_options")
+#else
+#  define SIMD_BEGIN_AVX2
+#  define SIMD_BEGIN_SSE41
+#  define SIMD_END
+#endif
+
+
+inline bool cpuHasSSE41() {
+#if !SIMD_X86
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 19)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+inline bool cpuHasAVX2() {
+#if !SIMD_X86
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27))) { return false; } // OSXSAVE
+	if ((_xgetbv(0) & 6) != 6) { return false; } // OS saves the YMM registers
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
@@ -0,0 +1,342 @@
+#include "wbvh.h"
+#include "simd.h"
+
+#include <algorithm>
+
+const float ROUNDING = 1.00000024f; // Same conservative far-plane bump as the binary BVH
+
+
+/****************************************************************************/
+
+template <int N>
+void WideBVH<N>::clear() {
+	nodes.clear();
+	slotOf.clear();
+	binary = NULL;
+}
+
+template <int N>
+void WideBVH<N>::build(const BVH& bvh) {
+	clear();
+	binary = &bvh;
+	slotOf.assign(bvh.nodes.size(), -1);
+
+	if (!bvh.nodes.empty()) {
+		collapse(0);
+	}
+}
+
+template <int N>
+void WideBVH<N>::refit(const std::vector<int>& binaryNodes) {
+	for (int r = 0; r < binaryNodes.size(); r++) {
+		int slot = slotOf[binaryNodes[r]];
+		if (slot < 0) { continue; } // Opened up into its parent's slots
+
+		const LinearBVHNode& c = binary->nodes[binaryNodes[r]];
+		WideBVHNode<N>& wide = nodes[slot / N];
+		for (int a = 0; a < 3; a++) {
+			wide.bounds[a][slot % N] = c.min[a];
+			wide.bounds[a + 3][slot % N] = c.max[a];
+		}
+	}
+}
+
+// Pull grandchildren up into this node, always opening the largest interior
+// child, until all N slots are used. Returns the index of the node written.
+template <int N>
+int WideBVH<N>::collapse(int binaryNode) {
+	const LinearBVHNode* bn = &binary->nodes[0];
+	int slots[N];
+	int used = 0;
+
+	if (bn[binaryNode].numPrims > 0) { // Only happens when the root is a leaf
+		slots[used++] = binaryNode;
+	}
+	else {
+		slots[used++] = binaryNode + 1;
+		slots[used++] = bn[binaryNode].offset;
+	}
+
+	while (used < N) {
+		int best = -1;
+		float bestArea = -1.f;
+
+		for (int i = 0; i < used; i++) {
+			const LinearBVHNode& c = bn[slots[i]];
+			if (c.numPrims == 0 && c.bounds().surfaceArea() > bestArea) {
+				best = i;
+				bestArea = c.bounds().surfaceArea();
+			}
+		}
+		if (best < 0) { break; }
+
+		int opened = slots[best];
+		slots[best] = opened + 1;
+		slots[used++] = bn[opened].offset;
+	}
+
+	int index = nodes.size();
+	nodes.push_back(WideBVHNode<N>());
+
+	WideBVHNode<N> wide;
+	for (int i = 0; i < N; i++) {
+		if (i < used) {
+			const LinearBVHNode& c = bn[slots[i]];
+			slotOf[slots[i]] = index * N + i;
+
+			for (int a = 0; a < 3; a++) {
+				wide.bounds[a][i] = c.min[a];
+				wide.bounds[a + 3][i] = c.max[a];
+			}
+			if (c.numPrims > 0) {
+				wide.child[i] = c.offset;
+				wide.count[i] = c.numPrims;
+			}
+			else {
+				wide.child[i] = collapse(slots[i]);
+				wide.count[i] = 0;
+			}
+		}
+		else { // Inverted box, never hit
+			for (int a = 0; a < 3; a++) {
+				wide.bounds[a][i] = FLT_MAX;
+				wide.bounds[a + 3][i] = -FLT_MAX;
+			}
+			wide.child[i] = -1;
+			wide.count[i] = -1;
+		}
+	}
+	nodes[index] = wide;
+	return index;
+}
+
+/****************************************************************************/
+
+struct WideStackEntry {
+	int child;
+	int count;
+	float t; // Entry distance of the child's box
+};
+
+// Rows of WideBVHNode::bounds holding the planes a ray enters and leaves
+// the boxes through along axis a.
+static inline int nearRow(const Ray& ray, int a) {
+	return a + 3 * ray.sign[a];
+}
+
+static inline int farRow(const Ray& ray, int a) {
+	return a + 3 - 3 * ray.sign[a];
+}
+
+// Push the children that were hit, far to near so the nearest is popped first.
+template <int N>
+static inline void pushHits(const WideBVHNode<N>& node, int mask, const float* tNear, WideStackEntry* stack, int& top) {
+	WideStackEntry hits[N];
+	int numHits = 0;
+
+	for (int i = 0; i < N; i++) {
+		if (!(mask & (1 << i)) || node.count[i] < 0) { continue; }
+
+		WideStackEntry entry = { node.child[i], node.count[i], tNear[i] };
+		int j = numHits++;
+		while (j > 0 && hits[j - 1].t < entry.t) {
+			hits[j] = hits[j - 1];
+			j--;
+		}
+		hits[j] = entry;
+	}
+	for (int i = 0; i < numHits; i++) {
+		stack[top++] = hits[i];
+	}
+}
+
+// Closest-hit traversal shared by every width. ChildTest fills tNear for all N
+// children and returns a bit mask of the ones the ray enters before dist.
+template <int N, typename ChildTest>
+static inline bool traverseWide(const WideBVH<N>& wbvh, const Ray& ray, ChildTest test,
+								float& dist, int& indexOfClosest, int& indexOfTriangle) {
+	if (wbvh.nodes.empty()) { return false; }
+
+	bool hit = false;
+	dist = std::min(dist, ray.tmax);
+	WideStackEntry stack[BVH_STACK_SIZE * N];
+	int top = 0;
+	WideStackEntry root = { 0, 0, 0.f };
+	stack[top++] = root;
+	COUNT_STAT(rays, 1);
+
+	while (top > 0) {
+		WideStackEntry entry = stack[--top];
+		if (entry.t > dist) { continue; } // Starts behind the closest hit so far
+
+		if (entry.count > 0) {
+			hit |= wbvh.binary->intersectLeaf(entry.child, entry.count, ray, dist, indexOfClosest, indexOfTriangle);
+			continue;
+		}
+
+		const WideBVHNode<N>& node = wbvh.nodes[entry.child];
+		COUNT_STAT(nodes, 1);
+
+		float tNear[N];
+		int mask = test(node, ray, dist, tNear);
+		pushHits<N>(node, mask, tNear, stack, top);
+	}
+	return hit;
+}
+
+// Any-hit version of traverseWide() for shadow rays, done at the first hit.
+template <int N, typename ChildTest>
+static inline bool occludedWide(const WideBVH<N>& wbvh, const Ray& ray, ChildTest test, int ignoreObject, int ignoreTriangle) {
+	if (wbvh.nodes.empty()) { return false; }
+
+	WideStackEntry stack[BVH_STACK_SIZE * N];
+	int top = 0;
+	WideStackEntry root = { 0, 0, 0.f };
+	stack[top++] = root;
+	COUNT_STAT(rays, 1);
+
+	while (top > 0) {
+		WideStackEntry entry = stack[--top];
+
+		if (entry.count > 0) {
+			if (wbvh.binary->occludedLeaf(entry.child, entry.count, ray, ignoreObject, ignoreTriangle)) {
+				return true;
+			}
+			continue;
+		}
+
+		const WideBVHNode<N>& node = wbvh.nodes[entry.child];
+		COUNT_STAT(nodes, 1);
+
+		float tNear[N];
+		int mask = test(node, ray, ray.tmax, tNear);
+		pushHits<N>(node, mask, tNear, stack, top);
+	}
+	return false;
+}
+
+// Portable version of the child test, one child at a time.
+template <int N>
+class ChildTestScalar {
+public:
+	int operator()(const WideBVHNode<N>& node, const Ray& ray, float dist, float* tNear) const {
+		int mask = 0;
+
+		for (int i = 0; i < N; i++) {
+			float tmin = 0.f;
+			float tmax = dist;
+			for (int a = 0; a < 3; a++) {
+				float t0 = (node.bounds[nearRow(ray, a)][i] - ray.e[a]) * ray.invD[a];
+				float t1 = (node.bounds[farRow(ray, a)][i] - ray.e[a]) * ray.invD[a] * ROUNDING;
+				tmin = (t0 > tmin) ? t0 : tmin;
+				tmax = (t1 < tmax) ? t1 : tmax;
+			}
+			tNear[i] = tmin;
+			mask |= (tmin <= tmax) ? (1 << i) : 0;
+		}
+		return mask;
+	}
+};
+
+#if SIMD_X86
+
+// Four slab tests at once. _mm_max_ps/_mm_min_ps return their second operand
+// when the first is NaN (0 * inf for an axis-parallel ray on a box face), so
+// the running tmin/tmax always go second.
+class ChildTestSSE {
+public:
+	int operator()(const WideBVHNode<4>& node, const Ray& ray, float dist, float* tNear) const {
+		__m128 tmin = _mm_setzero_ps();
+		__m128 tmax = _mm_set1_ps(dist);
+		const __m128 rounding = _mm_set1_ps(ROUNDING);
+
+		for (int a = 0; a < 3; a++) {
+			__m128 e = _mm_set1_ps(ray.e[a]);
+			__m128 invD = _mm_set1_ps(ray.invD[a]);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[nearRow(ray, a)]), e), invD);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[farRow(ray, a)]), e), invD);
+			tmin = _mm_max_ps(t0, tmin);
+			tmax = _mm_min_ps(_mm_mul_ps(t1, rounding), tmax);
+		}
+		_mm_storeu_ps(tNear, tmin);
+		return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+	}
+};
+
+template <>
+bool WideBVH<4>::intersect(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	return traverseWide<4>(*this, ray, ChildTestSSE(), dist, indexOfClosest, indexOfTriangle);
+}
+
+template <>
+bool WideBVH<4>::occluded(const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	return occludedWide<4>(*this, ray, ChildTestSSE(), ignoreObject, ignoreTriangle);
+}
+
+SIMD_BEGIN_AVX2
+
+// Eight slab tests at once, same NaN ordering as the SSE version.
+class ChildTestAVX2 {
+public:
+	int operator()(const WideBVHNode<8>& node, const Ray& ray, float dist, float* tNear) const {
+		__m256 tmin = _mm256_setzero_ps();
+		__m256 tmax = _mm256_set1_ps(dist);
+		const __m256 rounding = _mm256_set1_ps(ROUNDING);
+
+		for (int a = 0; a < 3; a++) {
+			__m256 e = _mm256_set1_ps(ray.e[a]);
+			__m256 invD = _mm256_set1_ps(ray.invD[a]);
+			__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[nearRow(ray, a)]), e), invD);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[farRow(ray, a)]), e), invD);
+			tmin = _mm256_max_ps(t0, tmin);
+			tmax = _mm256_min_ps(_mm256_mul_ps(t1, rounding), tmax);
+		}
+		_mm256_storeu_ps(tNear, tmin);
+		return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+	}
+};
+
+// Only called when cpuHasAVX2(). flatten pulls the generic traversal into
+// this AVX2 function so the child test is inlined rather than called per node.
+#if defined(__GNUC__)
+__attribute__((flatten))
+#endif
+static bool intersectBVH8(const BVH8& wbvh, const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) {
+	return traverseWide<8>(wbvh, ray, ChildTestAVX2(), dist, indexOfClosest, indexOfTriangle);
+}
+
+#if defined(__GNUC__)
+__attribute__((flatten))
+#endif
+static bool occludedBVH8(const BVH8& wbvh, const Ray& ray, int ignoreObject, int ignoreTriangle) {
+	return occludedWide<8>(wbvh, ray, ChildTestAVX2(), ignoreObject, ignoreTriangle);
+}
+
+SIMD_END
+
+template <>
+bool WideBVH<8>::intersect(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	return intersectBVH8(*this, ray, dist, indexOfClosest, indexOfTriangle);
+}
+
+template <>
+bool WideBVH<8>::occluded(const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	return occludedBVH8(*this, ray, ignoreObject, ignoreTriangle);
+}
+
+#else
+
+template <int N>
+bool WideBVH<N>::intersect(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) const {
+	return traverseWide<N>(*this, ray, ChildTestScalar<N>(), dist, indexOfClosest, indexOfTriangle);
+}
+
+template <int N>
+bool WideBVH<N>::occluded(const Ray& ray, int ignoreObject, int ignoreTriangle) const {
+	return occludedWide<N>(*this, ray, ChildTestScalar<N>(), ignoreObject, ignoreTriangle);
+}
+
+#endif
+
+template class WideBVH<4>;
+template class WideBVH<8>;
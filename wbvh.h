@@ -0,0 +1,36 @@
+#pragma once
+#include "bvh.h"
+
+
+// N-wide BVH node with the child boxes stored as structure of arrays, so one
+// SSE (N = 4) or AVX2 (N = 8) instruction sequence tests the ray against all
+// of them. bounds[0..2] are the x/y/z minimums, bounds[3..5] the maximums.
+template <int N>
+class alignas(64) WideBVHNode {
+public:
+	float bounds[6][N];
+	int child[N]; // Interior: node index. Leaf: first entry in BVH::packed
+	int count[N]; // 0 for interior children, primitive count for leaves, -1 if empty
+};
+
+// Collapsed copy of a binary BVH. The leaves still point into the packed
+// primitives of the BVH it was built from, so that one has to stay alive.
+template <int N>
+class WideBVH {
+public:
+	std::vector<WideBVHNode<N>, AlignedAllocator<WideBVHNode<N> > > nodes;
+	std::vector<int> slotOf; // wide node * N + slot holding each binary node, or -1
+	const BVH* binary = NULL;
+
+	void build(const BVH& bvh);
+	void clear();
+	void refit(const std::vector<int>& binaryNodes); // Copy bounds after BVH::refit()
+	bool intersect(const Ray& ray, float& dist, int& indexOfClosest, int& indexOfTriangle) const;
+	bool occluded(const Ray& ray, int ignoreObject, int ignoreTriangle) const; // See BVH::occluded()
+
+private:
+	int collapse(int binaryNode);
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;